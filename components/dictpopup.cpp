@@ -259,11 +259,12 @@ void DictPopup::load_data(const QString& selected_chinese_text) const
 {
     ui->original->setText(selected_chinese_text);
     QString sv_reading;
+    const auto chars = char_table.load();
     for (const auto& ch : selected_chinese_text)
     {
-        if (sv_readings.contains(ch))
+        if (const CharTable::Info& info = (*chars)[ch]; info.classes & CharTable::HAS_READING)
         {
-            sv_reading.append(sv_readings[ch]);
+            sv_reading.append(chars->reading(info));
         }
         else
         {
@@ -279,26 +280,26 @@ void DictPopup::load_data(const QString& selected_chinese_text) const
     if (current_name_set_id != -1)
     {
         ui->use_current_nameset->setChecked(true);
-        if (const auto [set_name, _] = name_set_dictionary.find_exact(selected_chinese_text); set_name != nullptr)
+        if (const auto set_entry = name_set_dictionary.find_exact(selected_chinese_text); set_entry.name)
         {
             set_name_found = true;
             ui->use_current_nameset->setCheckState(Qt::CheckState::Checked);
-            ui->current_name->setText(*set_name);
+            ui->current_name->setText(set_entry.name->toString());
         }
     }
 
-    const auto [global_name, phrases] = dictionary.find_exact(selected_chinese_text);
-    if (!set_name_found && global_name != nullptr)
+    const auto global_entry = dictionary.find_exact(selected_chinese_text);
+    if (!set_name_found && global_entry.name)
     {
-        ui->current_name->setText(*global_name);
+        ui->current_name->setText(global_entry.name->toString());
         ui->use_current_nameset->setChecked(false);
     }
 
-    if (phrases != nullptr && !phrases->empty())
+    if (global_entry.phrases)
     {
-        for (const auto& name : *phrases)
+        for (const auto& name : global_entry.phrases->split(QChar('\x1F')))
         {
-            auto* item = new QListWidgetItem(name);
+            auto* item = new QListWidgetItem(name.toString());
             item->setFlags(item->flags() & ~Qt::ItemIsEditable);
             ui->list_phrases->addItem(item);
         }
@@ -45,6 +45,18 @@ MainWindow::MainWindow(QWidget* parent) :
     });
     ui->menubar->addAction(reload_action);
 
+    auto* optimal_action = ui->menubar->addAction("Optimal segmentation");
+    optimal_action->setCheckable(true);
+    connect(optimal_action, &QAction::toggled, this, [this](const bool checked)
+    {
+        segmentation = checked ? Segmentation::Optimal : Segmentation::Greedy;
+        if (!input_text.isEmpty())
+        {
+            convert_and_display(true);
+        }
+    });
+    ui->menubar->addAction(optimal_action);
+
     auto* reload_data_action = ui->menubar->addAction("Reload dict");
     reload_data_action->setShortcut(QKeySequence("Ctrl+Shift+R"));
     connect(reload_data_action, &QAction::triggered, this, [this, reload_data_action]
@@ -52,15 +64,25 @@ MainWindow::MainWindow(QWidget* parent) :
         ui->progress_bar->setValue(0);
         ui->statusbar->showMessage("Reloading dictionary...");
         reload_data_action->setEnabled(false);
+        prune_timer.stop();
         QCoreApplication::processEvents();
         reload_dict([this, reload_data_action]
         {
             convert_and_display(true);
             reload_data_action->setEnabled(true);
+            prune_timer.start();
         });
     });
     ui->menubar->addAction(reload_data_action);
 
+    auto* about_action = ui->menubar->addAction("About");
+    connect(about_action, &QAction::triggered, this, [this]
+    {
+        QMessageBox::about(this, "About Hanvi",
+                           "<p><b>Hanvi</b>: Chinese to Vietnamese conversion.</p><pre>"
+                           + dictionary_report().toHtmlEscaped() + "</pre>");
+    });
+
     ui->left_right->setStretchFactor(0, 1);
     ui->left_right->setStretchFactor(1, 4);
 
@@ -111,6 +133,15 @@ MainWindow::MainWindow(QWidget* parent) :
     connect(ui->sv_output, &QTextBrowser::anchorClicked, this, &MainWindow::click_token);
     connect(ui->vn_output, &QTextBrowser::anchorClicked, this, &MainWindow::click_token);
 
+    // Removals leave dead branches in the dictionaries, and edits leave the global one off
+    // its double array; both are put right in the background every so often while nothing
+    // is being converted. Started once the dictionaries are loaded.
+    prune_timer.setInterval(std::chrono::minutes(2));
+    connect(&prune_timer, &QTimer::timeout, this, [this]
+    {
+        if (!watcher.isRunning() && !plain_watcher.isRunning()) prune_dictionaries_later();
+    });
+
     connect(&watcher, &QFutureWatcher<std::tuple<QString, QString, QString>>::finished, this,
             &MainWindow::update_display);
     connect(&plain_watcher, &QFutureWatcher<QString>::finished, this, [this]
@@ -174,11 +205,21 @@ MainWindow::MainWindow(QWidget* parent) :
         chooser->setAttribute(Qt::WA_DeleteOnClose);
         if (chooser->exec() == QDialog::Accepted)
         {
-            if (const int change_to = chooser->get_chosen_id(); change_to != -2 && change_to != current_name_set_id)
+            if (const int change_to = chooser->get_chosen_id(); change_to != -2)
             {
-                load_name_set(change_to);
-                convert_and_display(true);
-                load_data();
+                std::vector<int> stack;
+                if (change_to != -1) stack.push_back(change_to);
+                if (chooser->is_stacked())
+                {
+                    stack.insert(stack.end(), active_name_sets.begin(), active_name_sets.end());
+                }
+
+                if (stack != active_name_sets)
+                {
+                    set_active_name_sets(std::move(stack));
+                    convert_and_display(true);
+                    load_data();
+                }
             }
         }
     });
@@ -194,25 +235,24 @@ MainWindow::MainWindow(QWidget* parent) :
 
 void MainWindow::load_data()
 {
-    bool found = false;
-    for (const auto& [index, title] : name_sets)
+    QStringList titles;
+    std::vector<int> existing;
+    for (const int id : active_name_sets)
     {
-        if (index == current_name_set_id)
-        {
-            ui->current_name_set->setText(title);
-            found = true;
-            break;
-        }
+        const auto set = std::ranges::find(name_sets, id, &NameSet::index);
+        if (set == name_sets.end()) continue;
+
+        titles.append(set->title);
+        existing.push_back(id);
     }
 
-    if (!found)
+    ui->current_name_set->setText(titles.isEmpty() ? "None" : titles.join(" + "));
+    if (!prune_timer.isActive()) prune_timer.start();
+
+    if (existing != active_name_sets)
     {
-        ui->current_name_set->setText("None");
-        if (current_name_set_id != -1)
-        {
-            load_name_set(-1);
-            convert_and_display(true);
-        }
+        set_active_name_sets(std::move(existing));
+        convert_and_display(true);
     }
 }
 
@@ -247,16 +287,19 @@ void MainWindow::click_token(const QUrl& link) const
 
 MainWindow::~MainWindow()
 {
+    conversion_stop.request_stop();
     delete ui;
 }
 
 void MainWindow::convert_and_display(const bool scroll_back)
 {
-    if (watcher.isRunning()) {
-        return;
-    }
+    // Whatever is still converting was asked for before this and is no longer wanted. The
+    // source stays stopped until another job starts, so update_display() drops its result.
+    conversion_stop.request_stop();
+
     if (!input_text.isEmpty() && !pages[current_page].isEmpty())
     {
+        conversion_stop = std::stop_source();
         ui->statusbar->showMessage("Converting...");
 
         if (scroll_back)
@@ -269,16 +312,19 @@ void MainWindow::convert_and_display(const bool scroll_back)
         }
         else saved_scroll = {0, 0, 0};
 
-        auto reporter = [this](int progress)
+        const std::stop_token cancel = conversion_stop.get_token();
+        auto reporter = [this, cancel](int progress)
         {
-            QMetaObject::invokeMethod(this, [this, progress]
+            QMetaObject::invokeMethod(this, [this, progress, cancel]
             {
+                if (cancel.stop_requested()) return;
                 ui->progress_bar->setValue(static_cast<int>((progress * 100) / pages[current_page].length()));
             });
         };
 
+        // The page is copied so a cancelled job can still finish reading it after the text is replaced.
         const QFuture<std::tuple<QString, QString, QString>> future = QtConcurrent::run(
-            convert, pages[current_page], reporter);
+            convert, pages[current_page].toString(), LatticeSource::pin(), reporter, cancel, segmentation);
         watcher.setFuture(future);
     }
 }
@@ -298,7 +344,7 @@ void MainWindow::convert_to_file()
         };
 
         const QFuture<QString> future = QtConcurrent::run(
-            convert_plain, input_text, reporter);
+            convert_plain, input_text, LatticeSource::pin(), reporter, std::stop_token{}, segmentation);
         plain_watcher.setFuture(future);
     }
 }
@@ -438,6 +484,9 @@ static void set_line_height(const QTextBrowser* text_browser, const int height)
 
 void MainWindow::update_display()
 {
+    // The job was cancelled with nothing started after it, and its result is empty.
+    if (conversion_stop.stop_requested()) return;
+
     update_pagination_controls();
     ui->progress_bar->setValue(100);
     const auto [cn_out, sv_out, vn_out] = watcher.result();
@@ -2,7 +2,11 @@
 
 #include <QMainWindow>
 #include <QTextBrowser>
+#include <QTimer>
 #include <QtConcurrent>
+#include <stop_token>
+
+#include "../core/converter.h"
 
 QT_BEGIN_NAMESPACE
 
@@ -42,6 +46,9 @@ private:
     Ui::MainWindow* ui;
     QFutureWatcher<std::tuple<QString, QString, QString>> watcher;
     QFutureWatcher<QString> plain_watcher;
+    QTimer prune_timer;
+    std::stop_source conversion_stop;
+    Segmentation segmentation = Segmentation::Greedy;
     int saved_cursor_pos = -1;
     SavedScroll saved_scroll;
 
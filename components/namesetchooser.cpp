@@ -15,7 +15,7 @@ namesetchooser::namesetchooser(QWidget* parent) :
     ui->name_set_list->horizontalHeader()->setSectionResizeMode(1, QHeaderView::Fixed);
     ui->name_set_list->setColumnWidth(1, 80);
     ui->name_set_list->horizontalHeader()->setSectionResizeMode(2, QHeaderView::Fixed);
-    ui->name_set_list->setColumnWidth(2, 100);
+    ui->name_set_list->setColumnWidth(2, 160);
     ui->name_set_list->verticalHeader()->setVisible(false);
 
     connect(ui->name_set_choose_none, &QPushButton::clicked, this, [this] {
@@ -41,6 +41,11 @@ int namesetchooser::get_chosen_id() const
     return chosen_id;
 }
 
+bool namesetchooser::is_stacked() const
+{
+    return stacked;
+}
+
 void namesetchooser::load_data(const QString& filter)
 {
     ui->name_set_list->setRowCount(0);
@@ -83,7 +88,17 @@ void namesetchooser::load_data(const QString& filter)
             accept();
         });
 
+        const auto stack_button = new QPushButton("Stack");
+        stack_button->setObjectName("stack_set");
+        stack_button->setToolTip("Use on top of the active namesets");
+        connect(stack_button, &QPushButton::clicked, this, [this, index] {
+            chosen_id = index;
+            stacked = true;
+            accept();
+        });
+
         layout->addWidget(choose_button);
+        layout->addWidget(stack_button);
         ui->name_set_list->setCellWidget(row, 2, container);
     }
 }
@@ -22,10 +22,13 @@ public:
     ~namesetchooser() override;
 
     int get_chosen_id() const;
+    // Whether the chosen set goes on top of the active ones instead of replacing them.
+    bool is_stacked() const;
 
 private:
     Ui::namesetchooser* ui;
     int chosen_id = -2;
+    bool stacked = false;
 
     void load_data(const QString& filter = "");
 };
@@ -103,6 +103,7 @@ QWidget* NamesetsManager::create_action_widget(int id, const QString& current_ti
             {
                 return name_set.index == id;
             });
+            forget_name_set(id);
             load_data();
         }
     });
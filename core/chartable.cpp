@@ -0,0 +1,48 @@
+#include "chartable.h"
+
+static constexpr QStringView OPENERS(u"“‘([<{");
+static constexpr QStringView CLOSERS(u".,，;:!?)]}>\"'”’，。：；！？");
+static constexpr QStringView RULE_STOPPERS(u"，。：；！？“”’.,，;:!?)]}>\"'");
+static constexpr QStringView SENTENCE_ENDINGS(u".!?…:;\"");
+
+CharTable::CharTable()
+    : table(65536)
+{
+    build({}, {});
+}
+
+void CharTable::build(const QHash<QChar, QString>& sv_readings, const QHash<QChar, QChar>& punctuations)
+{
+    readings.clear();
+    readings.reserve(sv_readings.size());
+
+    for (int code = 0; code < 65536; ++code)
+    {
+        const QChar ch(static_cast<char16_t>(code));
+        Info& info = table[code];
+
+        info.reading = 0;
+        info.classes = 0;
+
+        if (OPENERS.contains(ch)) info.classes |= OPENER;
+        if (CLOSERS.contains(ch)) info.classes |= CLOSER;
+        if (RULE_STOPPERS.contains(ch)) info.classes |= RULE_STOPPER;
+        if ((code >= '0' && code <= '9') || (code >= 'A' && code <= 'Z') || (code >= 'a' && code <= 'z'))
+        {
+            info.classes |= ASCII_ALNUM;
+        }
+
+        if (const auto reading = sv_readings.constFind(ch); reading != sv_readings.cend())
+        {
+            info.reading = static_cast<uint32_t>(readings.size());
+            info.classes |= HAS_READING;
+            readings.push_back(reading.value());
+        }
+
+        info.normalized = punctuations.value(ch);
+        if (info.normalized.isNull()) info.normalized = ch;
+
+        if (SENTENCE_ENDINGS.contains(info.normalized)) info.classes |= ENDS_SENTENCE;
+        if (info.normalized == ',') info.classes |= PAUSE;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <QHash>
+#include <QString>
+#include <vector>
+
+// Everything the converter needs to know about a single UTF-16 code unit, indexed by
+// that code unit, so per-character decisions never touch a hash or scan a literal set.
+class CharTable
+{
+public:
+    enum Class : uint16_t
+    {
+        OPENER = 1 << 0,        // No space after it
+        CLOSER = 1 << 1,        // No space before it
+        RULE_STOPPER = 1 << 2,  // A grammar rule never reaches past it
+        ASCII_ALNUM = 1 << 3,
+        ENDS_SENTENCE = 1 << 4, // Its normalized form capitalizes what follows
+        PAUSE = 1 << 5,         // Its normalized form is a comma
+        HAS_READING = 1 << 6
+    };
+
+    struct Info
+    {
+        uint32_t reading;  // Index into readings, valid with HAS_READING
+        QChar normalized;  // The character itself when there is no punctuation mapping
+        uint16_t classes;
+    };
+
+    CharTable();
+
+    // Refills readings and normalized forms; the character classes never change.
+    void build(const QHash<QChar, QString>& sv_readings, const QHash<QChar, QChar>& punctuations);
+
+    [[nodiscard]] const Info& operator[](const QChar ch) const { return table[ch.unicode()]; }
+
+    [[nodiscard]] bool is(const QChar ch, const Class c) const { return table[ch.unicode()].classes & c; }
+
+    [[nodiscard]] QStringView reading(const Info& info) const { return readings[info.reading]; }
+
+    // The reading if there is one, else the normalized character. info must live in this table.
+    [[nodiscard]] QStringView reading_or_normalized(const Info& info) const
+    {
+        if (info.classes & HAS_READING) return readings[info.reading];
+        return {&info.normalized, 1};
+    }
+
+private:
+    std::vector<Info> table;
+    std::vector<QString> readings;
+};
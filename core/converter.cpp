@@ -1,70 +1,108 @@
-#include <QStringBuilder>
+#include <QtConcurrent>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
 
 #include "converter.h"
 #include "structures.h"
 #include "dict.h"
+#include "lattice.h"
 
+// Plain conversions this long are split into runs of paragraphs and converted in parallel.
+static constexpr int PARALLEL_THRESHOLD = 65536;
+static constexpr int PARALLEL_CHUNK_SIZE = 16384;
+
+// Reports progress every 2500 characters, and checks for cancellation at the same points.
 struct Progress
 {
-    const std::function<void(int)>& progress_callback = nullptr;
+    const std::function<void(int)>& progress_callback;
+    const std::stop_token& cancel;
     int next_val = 2500;
     int current = 0;
+    bool cancelled = false;
+
+    Progress(const std::function<void(int)>& callback, const std::stop_token& cancel)
+        : progress_callback(callback), cancel(cancel)
+    {
+    }
 
     void update(const int n)
     {
         current += n;
-        if (progress_callback && current >= next_val)
+        if (current >= next_val)
         {
-            progress_callback(current);
+            cancelled = cancel.stop_requested();
+            if (progress_callback) progress_callback(current);
             next_val += 2500;
         }
     }
+
+    [[nodiscard]] bool stopped() const { return cancelled; }
 };
 
-QString get_sv(const QStringView& cn)
+// Progress for several workers converting parts of one input, reported as their combined total.
+struct SharedProgress
 {
-    QString sv_reading;
-    for (const auto& ch : cn)
+    const std::function<void(int)>& progress_callback;
+    const std::stop_token& cancel;
+    std::atomic<int> current = 0;
+    std::atomic<bool> cancelled = false;
+    std::mutex report_mutex;
+
+    SharedProgress(const std::function<void(int)>& callback, const std::stop_token& cancel)
+        : progress_callback(callback), cancel(cancel)
     {
-        if (sv_readings.contains(ch))
-        {
-            sv_reading.append(sv_readings[ch]);
-        }
-        else
+    }
+
+    void update(const int n)
+    {
+        const int before = current.fetch_add(n, std::memory_order_relaxed);
+        if ((before + n) / 2500 != before / 2500)
         {
-            if (punctuations.contains(ch))
+            if (cancel.stop_requested()) cancelled.store(true, std::memory_order_relaxed);
+            if (progress_callback)
             {
-                sv_reading.append(punctuations[ch]);
+                std::lock_guard lock(report_mutex);
+                progress_callback(before + n);
             }
-            else sv_reading.append(ch);
         }
-        sv_reading.append(" ");
     }
-    if (!sv_reading.isEmpty()) sv_reading.resize(sv_reading.size() - 1);
 
-    return sv_reading;
-}
+    [[nodiscard]] bool stopped() const { return cancelled.load(std::memory_order_relaxed); }
+};
+
+// Counts nothing, for work whose progress was already reported, but still notices cancellation.
+struct QuietProgress
+{
+    const std::stop_token& cancel;
+
+    static void update(int)
+    {
+    }
 
-static bool should_append_space(const QStringView& input, const int current_end_idx,
+    [[nodiscard]] bool stopped() const { return cancel.stop_requested(); }
+};
+
+static bool should_append_space(const CharTable& chars, const QStringView& input, const int current_end_idx,
                                 const QChar current_char_source = QChar())
 {
-    static constexpr QStringView openers(u"“‘([<{");
     if (!current_char_source.isNull())
     {
-        if (openers.contains(current_char_source))
+        if (chars.is(current_char_source, CharTable::OPENER))
         {
             return false;
         }
     }
 
-    static constexpr QStringView closers(u".,，;:!?)]}>\"'”’，。：；！？");
-
     if (current_end_idx < input.length())
     {
         const QChar next_char = input[current_end_idx];
 
-        if (closers.contains(next_char))
+        if (chars.is(next_char, CharTable::CLOSER))
         {
             return false;
         }
@@ -76,14 +114,7 @@ static bool should_append_space(const QStringView& input, const int current_end_
         }
 
         if (!prev_char.isNull()) {
-            auto is_ascii_alphanumeric = [](const QChar& c) {
-                const ushort code = c.unicode();
-                return (code >= '0' && code <= '9') ||
-                       (code >= 'A' && code <= 'Z') ||
-                       (code >= 'a' && code <= 'z');
-            };
-
-            if (is_ascii_alphanumeric(prev_char) && is_ascii_alphanumeric(next_char)) {
+            if (chars.is(prev_char, CharTable::ASCII_ALNUM) && chars.is(next_char, CharTable::ASCII_ALNUM)) {
                 return false;
             }
         }
@@ -92,23 +123,28 @@ static bool should_append_space(const QStringView& input, const int current_end_
     return true;
 }
 
-static int is_optimal_phrase(const QStringView& text, const int current_pos, const int current_len)
+template <bool NameSetActive>
+static int is_optimal_phrase(const QStringView& text, const MatchLattice& lattice, const int current_pos,
+                             const int current_len)
 {
     const int threshold = std::max(current_len, 3);
 
     const int limit = current_pos + current_len;
+    const int end = static_cast<int>(text.length());
 
     for (int next_start = current_pos + 1; next_start < limit; ++next_start)
     {
-        if (current_name_set_id != -1)
+        const auto [set, global] = lattice.at(next_start, end);
+
+        if constexpr (NameSetActive)
         {
-            if (const Match match = name_set_dictionary.find(text, next_start); match.length > 0)
+            if (set.length > 0)
             {
                 return next_start;
             }
         }
 
-        if (const Match match = dictionary.find(text, next_start); match.priority == NAME || match.length > threshold)
+        if (global.priority == NAME || global.length > threshold)
         {
             return next_start;
         }
@@ -116,6 +152,23 @@ static int is_optimal_phrase(const QStringView& text, const int current_pos, con
     return -1;
 }
 
+// Longest name or phrase starting at current_pos that fits in max_len characters,
+// with the active name set winning ties. Same pick as probing every shorter length exactly.
+template <bool NameSetActive>
+static Match find_within(const MatchLattice& lattice, const int current_pos, const int max_len)
+{
+    const auto [set, global] = lattice.at(current_pos, current_pos + max_len);
+
+    if constexpr (NameSetActive)
+    {
+        if (set.length > 0 && set.priority == NAME && set.length >= global.length)
+        {
+            return set;
+        }
+    }
+    return global;
+}
+
 static void append_escaped(QString& buffer, const QStringView& view)
 {
     const QChar* data = view.data();
@@ -138,14 +191,6 @@ static void append_escaped(QString& buffer, const QStringView& view)
     }
 }
 
-struct ConversionResult
-{
-    QString cn;
-    QString sv;
-    QString vn;
-    int length_consumed = 0;
-};
-
 struct RuleMatch
 {
     const Rule* rule;
@@ -153,15 +198,21 @@ struct RuleMatch
     int total_end_pos; // Where the entire rule ends (start_of_end + length)
 };
 
-std::optional<RuleMatch> find_matching_rule(const QStringView& text, const int current_pos,
-                                            const std::vector<Rule>& rules)
+// How far past its start a rule may look for its end.
+static constexpr int RULE_WINDOW = 25;
+
+template <bool NameSetActive>
+std::optional<RuleMatch> find_matching_rule(const QStringView& text, const MatchLattice& lattice, const int current_pos,
+                                            const RuleSet& rules)
 {
-    static constexpr QStringView stoppers(u"，。：；！？“”’.,，;:!?)]}>\"'");
-    int limit = std::min(static_cast<int>(text.length()), current_pos + 25);
+    if (rules.empty()) return std::nullopt;
+
+    const int end = static_cast<int>(text.length());
+    int limit = std::min(static_cast<int>(text.length()), current_pos + RULE_WINDOW);
 
     for (int i = current_pos; i < limit; ++i)
     {
-        if (const QChar ch = text[i]; stoppers.contains(ch))
+        if (lattice.chars().is(text[i], CharTable::RULE_STOPPER))
         {
             limit = i;
             break;
@@ -169,684 +220,1147 @@ std::optional<RuleMatch> find_matching_rule(const QStringView& text, const int c
     }
 
     const QStringView search_area = text.sliced(current_pos, limit - current_pos);
-    std::optional<RuleMatch> best_match = std::nullopt;
 
-    for (const auto& rule : rules)
-    {
-        const int start_len = static_cast<int>(rule.original_start.length());
-        if (search_area.length() <= start_len) continue;
-
-        int search_offset = start_len;
+    // Every rule of a set shares its start.
+    const int start_len = static_cast<int>(rules[0].original_start.length());
+    if (search_area.length() <= start_len) return std::nullopt;
 
-        while (true)
-        {
-            const int relative_end_idx = static_cast<int>(search_area.indexOf(rule.original_end, search_offset));
+    // An end token is unsafe to take when a name runs into it from just before. That only
+    // depends on where the token starts, so each place is checked once for all rules.
+    std::array<int8_t, RULE_WINDOW + 1> safe_at;
+    safe_at.fill(-1);
 
-            if (relative_end_idx == -1) break;
+    auto is_safe = [&](const int abs_start_of_end)
+    {
+        int8_t& known = safe_at[abs_start_of_end - current_pos];
+        if (known >= 0) return known == 1;
 
-            const int abs_start_of_end = current_pos + relative_end_idx;
-            const int rule_end_len = static_cast<int>(rule.original_end.length());
+        known = 1;
+        const int lookback_limit = std::max(current_pos + start_len, abs_start_of_end - 6);
 
-            bool is_safe = true;
+        for (int k = abs_start_of_end; k >= lookback_limit; --k)
+        {
+            auto check_overlap = [&](const Match& m, const Priority target_prio)
+            {
+                return m.length > 0 && m.priority == target_prio && k + m.length > abs_start_of_end;
+            };
 
-            const int lookback_limit = std::max(current_pos + start_len, abs_start_of_end - 6);
+            const auto [set, global] = lattice.at(k, end);
 
-            for (int k = abs_start_of_end; k >= lookback_limit; --k)
+            if constexpr (NameSetActive)
             {
-                auto check_overlap = [&](const auto& dict, const Priority target_prio)
-                {
-                    Match m = dict.find(text, k);
-                    if (m.length > 0 && m.priority == target_prio)
-                    {
-                        if (k + m.length > abs_start_of_end)
-                        {
-                            return true;
-                        }
-                    }
-                    return false;
-                };
-
-                if (current_name_set_id != -1)
+                if (check_overlap(set, NAME))
                 {
-                    if (check_overlap(name_set_dictionary, NAME))
-                    {
-                        is_safe = false;
-                        break;
-                    }
-                }
-                if (check_overlap(dictionary, NAME))
-                {
-                    is_safe = false;
+                    known = 0;
                     break;
                 }
             }
-
-            if (!is_safe)
+            if (check_overlap(global, NAME))
             {
-                search_offset = relative_end_idx + 1;
-                continue;
+                known = 0;
+                break;
             }
+        }
+        return known == 1;
+    };
 
-            const int total_end = abs_start_of_end + rule_end_len;
+    // Only the first safe place a rule's end turns up at counts for it. Of those, the one
+    // reaching furthest wins, then the one with the longer end, then the rule listed first.
+    std::vector<bool> settled(rules.size());
+    std::optional<RuleMatch> best_match = std::nullopt;
+    size_t best_index = 0;
 
-            if (!best_match.has_value())
-            {
-                best_match = RuleMatch{&rule, abs_start_of_end, total_end};
-            }
-            else
+    rules.scan_ends(search_area, start_len, [&](const uint32_t index, const qsizetype at)
+    {
+        if (settled[index]) return;
+
+        const int abs_start_of_end = current_pos + static_cast<int>(at);
+        if (!is_safe(abs_start_of_end)) return;
+        settled[index] = true;
+
+        const Rule& rule = rules[index];
+        const int total_end = abs_start_of_end + static_cast<int>(rule.original_end.length());
+
+        if (best_match.has_value())
+        {
+            if (total_end < best_match->total_end_pos) return;
+            if (total_end == best_match->total_end_pos)
             {
-                if (total_end > best_match->total_end_pos)
-                {
-                    best_match = RuleMatch{&rule, abs_start_of_end, total_end};
-                }
-                else if (total_end == best_match->total_end_pos)
-                {
-                    if (rule.original_end.length() > best_match->rule->original_end.length())
-                    {
-                        best_match = RuleMatch{&rule, abs_start_of_end, total_end};
-                    }
-                }
+                const qsizetype best_len = best_match->rule->original_end.length();
+                if (rule.original_end.length() < best_len) return;
+                if (rule.original_end.length() == best_len && index > best_index) return;
             }
-            break;
         }
-    }
+        best_match = RuleMatch{&rule, abs_start_of_end, total_end};
+        best_index = index;
+    });
 
     return best_match;
 }
 
-ConversionResult convert_recursive(const QStringView& input, int start_offset, int& token_counter, bool& cap_next,
-                                   Progress& progress)
+// Appends view, upper-casing its first character when asked to and it is lower case.
+static void append_capitalized(QString& buffer, const QStringView& view, const bool capitalize)
 {
-    ConversionResult out;
-    int i = 0;
+    const qsizetype at = buffer.size();
+    buffer += view;
+    if (capitalize && !view.isEmpty() && view[0].isLower())
+    {
+        buffer[at] = view[0].toUpper();
+    }
+}
+
+// Output sinks. The converter core decides what every token is and how it is capitalized;
+// a sink only decides how that is written. Each rule opens a frame, and ends_with_space()
+// only looks at what was written since the innermost frame started.
 
-    while (i < input.length())
+// Three linked panes (Chinese, Sino-Vietnamese, Vietnamese) sharing token ids. Everything is
+// streamed into three buffers sized up front; a rule's inner tokens land directly between
+// its opening and closing links, so nothing is built on the side and copied in afterwards.
+class HtmlSink
+{
+public:
+    HtmlSink(const qsizetype input_length, const CharTable& chars)
+        : chars(chars)
     {
-        QChar ch = input[i];
+        // Roughly what one linked token costs per source character in each pane.
+        cn.reserve(input_length * 20 + 128);
+        sv.reserve(input_length * 28 + 128);
+        vn.reserve(input_length * 28 + 128);
 
-        if (ch == '\n')
-        {
-            out.cn += u"<br>";
-            out.sv += u"<br>";
-            out.vn += u"<br>";
-            cap_next = true;
-            i++;
-            out.length_consumed++;
+        cn += uR"(<style>a{text-decoration:none;color:white;font-family:"Noto Sans SC";font-size:18px}</style>)";
+        sv += uR"(<style>a{text-decoration:none;color:white;font-family:"Tahoma";font-size:16px}</style>)";
+        vn += uR"(<style>a{text-decoration:none;color:white;font-family:"Tahoma";font-size:16px;}</style>)";
 
-            progress.update(1);
-            continue;
-        }
-        if (ch.isSpace())
-        {
-            out.cn += u"&nbsp;";
-            out.sv += u"&nbsp;";
-            out.vn += u"&nbsp;";
-            i++;
-            out.length_consumed++;
+        frames.push_back({-1, vn.size()});
+    }
 
-            progress.update(1);
-            continue;
-        }
+    void line_break()
+    {
+        cn += u"<br>";
+        sv += u"<br>";
+        vn += u"<br>";
+    }
 
-        if (current_name_set_id != -1)
-        {
-            if (Match match = name_set_dictionary.find(input, i); match.length > 0 && match.priority == NAME)
-            {
-                QString uid = QString::number(token_counter++);
-                QString sv = get_sv(input.sliced(i, match.length));
-                if (cap_next)
-                {
-                    sv[0] = sv[0].toUpper();
-                    cap_next = false;
-                }
+    void space()
+    {
+        cn += u"&nbsp;";
+        sv += u"&nbsp;";
+        vn += u"&nbsp;";
+    }
 
-                QString trans = *match.translation;
+    // Names keep their stored casing; only the reading is capitalized.
+    void name(const QStringView& source, const QStringView& translation, const QStringView& reading,
+              const bool capitalize)
+    {
+        word(source, translation, reading, capitalize, false);
+    }
 
-                out.cn += u"<a href='" % uid % u"'>";
-                append_escaped(out.cn, input.sliced(i, match.length));
-                out.cn += u"</a>";
+    void phrase(const QStringView& source, const QStringView& translation, const QStringView& reading,
+                const bool capitalize)
+    {
+        word(source, translation, reading, capitalize, capitalize);
+    }
 
-                out.sv += u"<a href='" % uid % u"'>" % sv.toHtmlEscaped() % u"</a>";
-                out.vn += u"<a href='" % uid % u"'>" % trans.toHtmlEscaped() % u"</a>";
+    void character(const QChar source, const QStringView& translated, const bool capitalize)
+    {
+        const int uid = token_counter++;
 
-                i += match.length;
-                out.length_consumed += match.length;
+        open_link(cn, uid);
+        append_escaped(cn, QStringView(&source, 1));
+        close_link(cn);
 
-                progress.update(match.length);
+        open_link(sv, uid);
+        append_escaped_capitalized(sv, translated, capitalize);
+        close_link(sv);
 
-                if (should_append_space(input, i) && !out.vn.endsWith(' '))
-                {
-                    out.vn += u" ";
-                    out.sv += u" ";
-                }
+        open_link(vn, uid);
+        append_escaped_capitalized(vn, translated, capitalize);
+        close_link(vn);
+    }
 
-                continue;
-            }
-        }
+    void open_rule(const Rule& rule, const QString& translation_start)
+    {
+        const int uid = token_counter++;
 
-        auto [length, priority, rules, translation] = dictionary.find(input, i);
+        open_link(cn, uid, true);
+        append_escaped(cn, rule.original_start);
+        close_link(cn);
 
-        if (length > 0 && priority == NAME)
+        open_link(sv, uid, true);
+        append_sv(sv, rule.original_start, false);
+        sv += u" </a>";
+
+        if (!translation_start.isEmpty())
         {
-            QString uid = QString::number(token_counter++);
-            QString sv = get_sv(input.sliced(i, length));
-            if (cap_next)
-            {
-                sv[0] = sv[0].toUpper();
-                cap_next = false;
-            }
+            open_link(vn, uid, true);
+            append_escaped(vn, translation_start);
+            vn += u" </a>";
+        }
+
+        frames.push_back({uid, vn.size()});
+    }
+
+    void close_rule(const Rule& rule, const QString&)
+    {
+        const int uid = frames.back().uid;
+        frames.pop_back();
+
+        open_link(cn, uid, true);
+        append_escaped(cn, rule.original_end);
+        close_link(cn);
 
-            QString trans = *translation;
+        open_link(sv, uid, true);
+        append_sv(sv, rule.original_end, false);
+        sv += u"</a> ";
 
-            out.cn += u"<a href='" % uid % u"'>";
-            append_escaped(out.cn, input.sliced(i, length));
-            out.cn += u"</a>";
+        if (!rule.translation_end.isEmpty())
+        {
+            open_link(vn, uid, true);
+            append_escaped(vn, rule.translation_end);
+            close_link(vn);
+        }
+    }
 
-            out.sv += u"<a href='" % uid % u"'>" % sv.toHtmlEscaped() % u"</a>";
-            out.vn += u"<a href='" % uid % u"'>" % trans.toHtmlEscaped() % u"</a>";
+    [[nodiscard]] bool ends_with_space() const
+    {
+        return vn.size() > frames.back().vn_start && vn.back() == u' ';
+    }
 
-            i += length;
-            out.length_consumed += length;
+    void space_after_token()
+    {
+        vn += u' ';
+        sv += u' ';
+    }
 
-            progress.update(length);
+    void space_after_rule()
+    {
+        vn += u' ';
+    }
 
-            if (should_append_space(input, i) && !out.vn.endsWith(' '))
-            {
-                out.vn += u" ";
-                out.sv += u" ";
-            }
+    std::tuple<QString, QString, QString> finish()
+    {
+        return {std::move(cn), std::move(sv), std::move(vn)};
+    }
 
-            continue;
-        }
+private:
+    struct Frame
+    {
+        int uid;
+        qsizetype vn_start; // Where this frame's Vietnamese output begins
+    };
 
-        if (rules != nullptr)
+    const CharTable& chars;
+    QString cn;
+    QString sv;
+    QString vn;
+    std::vector<Frame> frames;
+    int token_counter = 0;
+
+    static void open_link(QString& buffer, const int uid, const bool rule = false)
+    {
+        buffer += u"<a href='";
+        if (rule) buffer += u'r';
+
+        char16_t digits[10];
+        char16_t* end = digits + std::size(digits);
+        char16_t* p = end;
+        unsigned value = uid;
+        do
         {
-            if (auto rule_match = find_matching_rule(input, i, *rules))
-            {
-                const Rule* rule = rule_match->rule;
-                int rule_start_len = static_cast<int>(rule->original_start.length());
+            *--p = static_cast<char16_t>(u'0' + value % 10);
+            value /= 10;
+        }
+        while (value != 0);
+        buffer.append(reinterpret_cast<const QChar*>(p), end - p);
 
-                bool phrase_overrides_rule = (length > 0 && priority == PHRASE &&
-                    length > rule_start_len);
+        buffer += u"'>";
+    }
 
-                if (!phrase_overrides_rule)
-                {
-                    int inner_start_idx = i + rule_start_len;
-                    int inner_len = rule_match->abs_start_of_end_token - inner_start_idx;
-                    int rule_end_len = static_cast<int>(rule->original_end.length());
+    static void close_link(QString& buffer)
+    {
+        buffer += u"</a>";
+    }
 
-                    progress.update(rule_start_len);
+    // Lower-case letters never need escaping, so the first character can be fixed up in place.
+    static void append_escaped_capitalized(QString& buffer, const QStringView& view, const bool capitalize)
+    {
+        const qsizetype at = buffer.size();
+        append_escaped(buffer, view);
+        if (capitalize && buffer.size() > at && buffer[at].isLower())
+        {
+            buffer[at] = buffer[at].toUpper();
+        }
+    }
 
-                    QString uid = "r" + QString::number(token_counter++);
+    // Space-separated readings of every character in cn, escaped, optionally upper-casing
+    // the first character.
+    void append_sv(QString& buffer, const QStringView& cn, const bool capitalize) const
+    {
+        const qsizetype at = buffer.size();
+        bool first = true;
+        for (const QChar ch : cn)
+        {
+            if (!first) buffer += u' ';
+            first = false;
 
-                    QString t_start = rule->translation_start;
-                    if (cap_next && !t_start.isEmpty())
-                    {
-                        if (t_start[0].isLower()) t_start[0] = t_start[0].toUpper();
-                        cap_next = false;
-                    }
+            append_escaped(buffer, chars.reading_or_normalized(chars[ch]));
+        }
+        if (capitalize && buffer.size() > at)
+        {
+            buffer[at] = buffer[at].toUpper();
+        }
+    }
 
-                    ConversionResult inner = convert_recursive(input.sliced(inner_start_idx, inner_len),
-                                                               start_offset + inner_start_idx,
-                                                               token_counter,
-                                                               cap_next, progress);
+    // reading is the stored reading of source, or empty when the dictionary has none to offer.
+    void word(const QStringView& source, const QStringView& translation, const QStringView& reading,
+              const bool capitalize_reading, const bool capitalize_translation)
+    {
+        const int uid = token_counter++;
 
-                    progress.update(rule_end_len);
+        open_link(cn, uid);
+        append_escaped(cn, source);
+        close_link(cn);
 
-                    out.cn += u"<a href='" % uid % u"'>";
-                    append_escaped(out.cn, rule->original_start);
-                    out.cn += u"</a>";
-                    out.cn += inner.cn;
-                    out.cn += u"<a href='" % uid % u"'>";
-                    append_escaped(out.cn, rule->original_end);
-                    out.cn += u"</a>";
+        open_link(sv, uid);
+        if (reading.isEmpty())
+        {
+            append_sv(sv, source, capitalize_reading);
+        }
+        else
+        {
+            const qsizetype at = sv.size();
+            append_escaped(sv, reading);
+            if (capitalize_reading) sv[at] = sv[at].toUpper();
+        }
+        close_link(sv);
 
-                    QString sv_start = get_sv(rule->original_start);
-                    QString sv_end = get_sv(rule->original_end);
+        open_link(vn, uid);
+        append_escaped_capitalized(vn, translation, capitalize_translation);
+        close_link(vn);
+    }
+};
 
-                    out.sv += u"<a href='" % uid % u"'>" % sv_start.toHtmlEscaped() % u" </a>";
-                    out.sv += inner.sv;
-                    out.sv += u"<a href='" % uid % u"'>" % sv_end.toHtmlEscaped() % u"</a> ";
+// Just the Vietnamese text, written straight into one buffer.
+class PlainSink
+{
+public:
+    void line_break()
+    {
+        text += u"\n";
+    }
 
-                    if (!t_start.isEmpty())
-                    {
-                        out.vn += u"<a href='" % uid % u"'>" % t_start.toHtmlEscaped() % u" </a>";
-                    }
+    void space()
+    {
+        text += u" ";
+    }
 
-                    out.vn += inner.vn;
+    void name(const QStringView&, const QStringView& translation, const QStringView&, bool)
+    {
+        text += translation;
+    }
 
-                    if (!rule->translation_end.isEmpty())
-                    {
-                        out.vn += u"<a href='" % uid % u"'>" % rule->translation_end.toHtmlEscaped() % u"</a>";
-                    }
+    void phrase(const QStringView&, const QStringView& translation, const QStringView&, const bool capitalize)
+    {
+        append_capitalized(text, translation, capitalize);
+    }
 
-                    i += rule_start_len + inner_len + rule_end_len;
-                    out.length_consumed += rule_start_len + inner_len + rule_end_len;
+    void character(QChar, const QStringView& translated, const bool capitalize)
+    {
+        append_capitalized(text, translated, capitalize);
+    }
 
-                    if (should_append_space(input, i) && !out.vn.endsWith(' '))
-                    {
-                        out.vn += u" ";
-                    }
-                    continue;
-                }
-            }
+    void open_rule(const Rule&, const QString& translation_start)
+    {
+        if (!translation_start.isEmpty())
+        {
+            text += translation_start;
+            text += u" ";
         }
+        frame_starts.push_back(text.size());
+    }
 
-        if (length > 0 && priority == PHRASE)
+    void close_rule(const Rule& rule, const QString&)
+    {
+        frame_starts.pop_back();
+
+        if (!rule.translation_end.isEmpty())
         {
-            if (int conflict_start = is_optimal_phrase(input, i, length); conflict_start != -1)
-            {
-                int max_allowed_len = conflict_start - i;
+            if (!ends_with_space()) text += u" ";
+            text += rule.translation_end;
+        }
+    }
 
-                length = 0;
-                translation = nullptr;
+    [[nodiscard]] bool ends_with_space() const
+    {
+        const qsizetype frame_start = frame_starts.empty() ? 0 : frame_starts.back();
+        return text.size() > frame_start && text.endsWith(' ');
+    }
 
-                for (int try_len = max_allowed_len; try_len >= 1; --try_len)
-                {
-                    const auto try_string = input.sliced(i, try_len);
-                    if (current_name_set_id != -1)
-                    {
-                        if (auto [set_name, _] = name_set_dictionary.find_exact(try_string); set_name)
-                        {
-                            length = try_len;
-                            translation = set_name;
-                            break;
-                        }
-                    }
-                    auto [exact_name, exact_phrases] = dictionary.find_exact(try_string);
-                    if (exact_name)
-                    {
-                        length = try_len;
-                        translation = exact_name;
-                        break;
-                    }
-                    if (exact_phrases && !exact_phrases->isEmpty())
-                    {
-                        length = try_len;
-                        translation = &exact_phrases->first();
-                        break;
-                    }
-                }
-            }
+    void space_after_token()
+    {
+        text += u" ";
+    }
 
-            if (length == 0)
-            {
-                goto process_single_char;
-            }
+    void space_after_rule()
+    {
+        text += u" ";
+    }
 
-            QString uid = QString::number(token_counter++);
-            QString sv = get_sv(input.sliced(i, length));
-            QString trans = *translation;
+    void append(const PlainSink& other)
+    {
+        text += other.text;
+    }
 
-            if (cap_next)
-            {
-                if (!trans.isEmpty() && trans[0].isLower()) trans[0] = trans[0].toUpper();
-                sv[0] = sv[0].toUpper();
-                cap_next = false;
-            }
+    QString finish()
+    {
+        return text.trimmed();
+    }
 
-            out.cn += u"<a href='" % uid % u"'>";
-            append_escaped(out.cn, input.sliced(i, length));
-            out.cn += u"</a>";
+private:
+    QString text;
+    std::vector<qsizetype> frame_starts;
+};
 
-            out.sv += u"<a href='" % uid % u"'>" % sv.toHtmlEscaped() % u"</a>";;
-            out.vn += u"<a href='" % uid % u"'>" % trans.toHtmlEscaped() % u"</a>";;
+// Writes the tokens an engine picks to the sink, so capitalization, spacing and progress come
+// out the same whichever engine picked them. The next token starts at i; input ends where the
+// span being written does.
+template <typename Sink, typename Reporter>
+struct TokenWriter
+{
+    const CharTable& chars;
+    QStringView input;
+    Sink& sink;
+    bool& cap_next;
+    Reporter& progress;
+    int i;
+
+    // A newline or any other whitespace character.
+    void blank()
+    {
+        if (input[i] == '\n')
+        {
+            sink.line_break();
+            cap_next = true;
+        }
+        else
+        {
+            sink.space();
+        }
+        i++;
 
-            i += length;
-            out.length_consumed += length;
+        progress.update(1);
+    }
 
-            progress.update(length);
+    void name(const int length, const QStringView& translation, const QStringView& reading)
+    {
+        sink.name(input.sliced(i, length), translation, reading, std::exchange(cap_next, false));
+        i += length;
 
-            if (should_append_space(input, i) && !out.vn.endsWith(' '))
-            {
-                out.vn += u" ";
-                out.sv += u" ";
-            }
+        progress.update(length);
+        separate();
+    }
 
-            continue;
-        }
+    void phrase(const int length, const QStringView& translation, const QStringView& reading)
+    {
+        sink.phrase(input.sliced(i, length), translation, reading, std::exchange(cap_next, false));
+        i += length;
 
-    process_single_char:
+        progress.update(length);
+        separate();
+    }
+
+    // Writes the rule's start and returns its translation as written, which closing the rule
+    // needs. The engine writes the inner text in between, ending at the rule's end token.
+    QString open_rule(const RuleMatch& match)
+    {
+        progress.update(static_cast<int>(match.rule->original_start.length()));
+
+        QString t_start = match.rule->translation_start;
+        if (cap_next && !t_start.isEmpty())
         {
-            QString source_text = input[i];
-            QString translated_text;
-            QString sv_text;
-            bool is_punctuator = false;
+            if (t_start[0].isLower()) t_start[0] = t_start[0].toUpper();
+            cap_next = false;
+        }
 
-            if (sv_readings.contains(ch))
-            {
-                translated_text = sv_readings[ch];
-                sv_text = translated_text;
-            }
-            else
-            {
-                QChar mapped = punctuations.value(ch);
-                translated_text = !mapped.isNull() ? mapped : ch;
-                sv_text = translated_text;
+        sink.open_rule(*match.rule, t_start);
+        return t_start;
+    }
 
-                static constexpr QStringView punctuators(u".!?…:;\"");
-                static constexpr QStringView comma(u",");
+    void close_rule(const RuleMatch& match, const QString& t_start)
+    {
+        progress.update(static_cast<int>(match.rule->original_end.length()));
+        sink.close_rule(*match.rule, t_start);
+        i = match.total_end_pos;
 
-                if (punctuators.contains(translated_text))
-                {
-                    cap_next = true;
-                    is_punctuator = true;
-                }
-                else if (comma.contains(translated_text))
-                {
-                    is_punctuator = true;
-                }
-            }
+        if (should_append_space(chars, input, i) && !sink.ends_with_space())
+        {
+            sink.space_after_rule();
+        }
+    }
 
-            if (!is_punctuator && cap_next && !translated_text.isEmpty())
+    // Nothing in the dictionary starts here: fall back to the character's reading, or its
+    // normalized punctuation.
+    void character()
+    {
+        const QChar ch = input[i];
+        const CharTable::Info& info = chars[ch];
+        const QStringView translated = chars.reading_or_normalized(info);
+        bool is_punctuator = false;
+
+        if (!(info.classes & CharTable::HAS_READING))
+        {
+            if (info.classes & CharTable::ENDS_SENTENCE)
             {
-                if (translated_text[0].isLower()) translated_text[0] = translated_text[0].toUpper();
-                if (!sv_text.isEmpty() && sv_text[0].isLower()) sv_text[0] = sv_text[0].toUpper();
-                cap_next = false;
+                cap_next = true;
+                is_punctuator = true;
             }
+            else if (info.classes & CharTable::PAUSE)
+            {
+                is_punctuator = true;
+            }
+        }
 
-            QString uid = QString::number(token_counter++);
-            out.cn += u"<a href='" % uid % u"'>";
-            append_escaped(out.cn, source_text);
-            out.cn += u"</a>";
-
-            out.sv += u"<a href='" % uid % u"'>" % sv_text.toHtmlEscaped() % u"</a>";;
-            out.vn += u"<a href='" % uid % u"'>" % translated_text.toHtmlEscaped() % u"</a>";;
+        bool capitalize = false;
+        if (!is_punctuator && cap_next && !translated.isEmpty())
+        {
+            capitalize = true;
+            cap_next = false;
+        }
 
-            i += 1;
-            out.length_consumed += 1;
+        sink.character(ch, translated, capitalize);
+        i += 1;
 
-            progress.update(1);
+        progress.update(1);
 
-            if (!translated_text.isEmpty() && should_append_space(input, i, ch) && !out.vn.endsWith(' '))
-            {
-                out.vn += u" ";
-                out.sv += u" ";
-            }
+        if (!translated.isEmpty() && should_append_space(chars, input, i, ch) && !sink.ends_with_space())
+        {
+            sink.space_after_token();
         }
     }
-    return out;
-}
 
-struct PlainResult
-{
-    QString text;
-    int length_consumed = 0;
+private:
+    void separate()
+    {
+        if (should_append_space(chars, input, i) && !sink.ends_with_space())
+        {
+            sink.space_after_token();
+        }
+    }
 };
 
-PlainResult convert_recursive_plain(const QStringView& input, bool& cap_next, Progress& progress)
+// Longest match first: a name wins outright, then a rule unless a longer phrase covers its
+// start, then the phrase cut short where a name or a much longer phrase begins inside it.
+// A rule's inner text gets a frame of its own on an explicit stack rather than a recursive
+// call, and is written straight into the sink between the rule's start and end.
+template <typename Sink, bool NameSetActive, typename Reporter>
+static int convert_greedy(const QStringView& input, const int begin, const int stop, const MatchLattice& lattice,
+                          Sink& sink, bool& cap_next, Reporter& progress)
 {
-    PlainResult out;
-    int i = 0;
+    struct Frame
+    {
+        TokenWriter<Sink, Reporter> out;
+        int stop;
+        RuleMatch rule{}; // The rule whose inner text the frame above converts
+        QString t_start;
+    };
+
+    std::vector<Frame> frames;
+    frames.push_back({{lattice.chars(), input, sink, cap_next, progress, begin}, stop, {}, {}});
 
-    while (i < input.length())
+    while (true)
     {
-        QChar ch = input[i];
+        Frame& frame = frames.back();
+        TokenWriter<Sink, Reporter>& out = frame.out;
 
-        if (ch == '\n')
+        if (out.i >= frame.stop || progress.stopped())
         {
-            out.text += u"\n";
-            cap_next = true;
-            i++;
-            out.length_consumed++;
+            if (frames.size() == 1) return out.i;
 
-            progress.update(1);
+            frames.pop_back();
+            Frame& outer = frames.back();
+            outer.out.close_rule(outer.rule, outer.t_start);
+            continue;
+        }
+
+        const QStringView text = out.input;
+        const int end = static_cast<int>(text.length());
+        const int i = out.i;
 
+        if (text[i].isSpace())
+        {
+            out.blank();
             continue;
         }
-        if (ch.isSpace())
+
+        const auto [set, global] = lattice.at(i, end);
+
+        if constexpr (NameSetActive)
         {
-            out.text += u" ";
-            i++;
-            out.length_consumed++;
+            if (set.length > 0 && set.priority == NAME)
+            {
+                out.name(set.length, set.translation, set.reading);
+                continue;
+            }
+        }
 
-            progress.update(1);
+        auto [length, priority, rules, translation, reading] = global;
 
+        if (length > 0 && priority == NAME)
+        {
+            out.name(length, translation, reading);
             continue;
         }
 
-        if (current_name_set_id != -1)
+        if (rules != nullptr)
         {
-            if (Match match = name_set_dictionary.find(input, i); match.length > 0 && match.priority == NAME)
+            if (auto rule_match = find_matching_rule<NameSetActive>(text, lattice, i, *rules))
             {
-                QString trans = *match.translation;
-                if (cap_next)
-                {
-                    cap_next = false;
-                }
-
-                out.text += trans;
-                i += match.length;
-                out.length_consumed += match.length;
+                const int start_len = static_cast<int>(rule_match->rule->original_start.length());
 
-                progress.update(match.length);
+                const bool phrase_overrides_rule = (length > 0 && priority == PHRASE &&
+                    length > start_len);
 
-                if (should_append_space(input, i) && !out.text.endsWith(' '))
+                if (!phrase_overrides_rule)
                 {
-                    out.text += u" ";
-                }
+                    frame.rule = *rule_match;
+                    frame.t_start = out.open_rule(*rule_match);
 
-                continue;
+                    const int inner_end_idx = rule_match->abs_start_of_end_token;
+                    frames.push_back({{out.chars, text.first(inner_end_idx), sink, cap_next, progress,
+                                       i + start_len}, inner_end_idx, {}, {}});
+                    continue;
+                }
             }
         }
 
-        auto [length, priority, rules, translation] = dictionary.find(input, i);
-
-        if (length > 0 && priority == NAME)
+        if (length > 0 && priority == PHRASE)
         {
-            QString trans = *translation;
-            if (cap_next)
+            if (const int conflict_start = is_optimal_phrase<NameSetActive>(text, lattice, i, length);
+                conflict_start != -1)
             {
-                cap_next = false;
+                const Match shorter = find_within<NameSetActive>(lattice, i, conflict_start - i);
+                length = shorter.length;
+                translation = shorter.translation;
+                reading = shorter.reading;
             }
-            out.text += trans;
-            i += length;
-            out.length_consumed += length;
 
-            if (should_append_space(input, i) && !out.text.endsWith(' '))
+            if (length > 0)
             {
-                out.text += u" ";
+                out.phrase(length, translation, reading);
+                continue;
             }
+        }
 
-            progress.update(length);
+        out.character();
+    }
+}
 
-            continue;
-        }
+// What the optimal engine scores a token: its weight times the square of its length, so one
+// long match beats the same text cut into shorter ones, and a name beats a phrase of its own
+// length but not one much longer. A rule is weighed by its start and end tokens.
+static constexpr int64_t SCORE_CHARACTER = 1;
+static constexpr int64_t SCORE_PHRASE = 2;
+static constexpr int64_t SCORE_RULE = 3;
+static constexpr int64_t SCORE_NAME = 4;
+static constexpr int64_t SCORE_NAME_SET = 5;
 
-        if (rules != nullptr)
-        {
-            if (auto rule_match = find_matching_rule(input, i, *rules))
-            {
-                const Rule* rule = rule_match->rule;
-                int start_len = static_cast<int>(rule->original_start.length());
+static int64_t squared(const qsizetype length)
+{
+    return static_cast<int64_t>(length) * length;
+}
 
-                bool phrase_overrides_rule = (length > 0 && priority == PHRASE &&
-                    length > start_len);
+// One token of a path through the lattice.
+struct Step
+{
+    enum Kind : uint8_t
+    {
+        BLANK,
+        CHARACTER,
+        WORD,
+        RULE
+    };
+
+    Kind kind;
+    int length;
+    const PrefixHit* hit; // The name or phrase of a WORD
+    RuleMatch rule; // For a RULE
+};
 
-                if (!phrase_overrides_rule)
+// Best-scoring ways to cut spans of one input into tokens. Each position is reached by the
+// best of the tokens ending there, so a span costs one pass over its hits. A rule counts the
+// best path through its inner text as well, worked out once however many paths ask for it.
+// Like the writers, this never recurses: a span's inner spans are found first and scored
+// innermost first, on a list of their own.
+template <bool NameSetActive>
+class PathFinder
+{
+public:
+    PathFinder(const QStringView& input, const MatchLattice& lattice)
+        : input(input), lattice(lattice)
+    {
+    }
+
+    [[nodiscard]] const CharTable& chars() const { return lattice.chars(); }
+
+    // Score of the best path through input[begin, stop), which holds no newline, with tokens
+    // that only see the text before stop. Fills steps with the path, in order, when given.
+    int64_t solve(const int begin, const int stop, std::vector<Step>* steps)
+    {
+        // Every rule inside the span whose inner text has no score yet, and every one inside
+        // those, each found once with the matches its own pass will need.
+        std::vector<Span> spans;
+        spans.push_back({begin, stop, find_rules(begin, stop)});
+        for (size_t next = 0; next < spans.size(); ++next)
+        {
+            for (size_t r = 0; r < spans[next].rules.size(); ++r)
+            {
+                const auto [inner_begin, inner_stop] = inner_span(spans[next].rules[r]);
+                if (inner_begin >= inner_stop || !inner_scores.try_emplace(key(inner_begin, inner_stop)).second)
                 {
-                    int inner_start_idx = i + start_len;
-                    int inner_len = rule_match->abs_start_of_end_token - inner_start_idx;
-                    int end_len = static_cast<int>(rule->original_end.length());
+                    continue;
+                }
+                spans.push_back({inner_begin, inner_stop, find_rules(inner_begin, inner_stop)});
+            }
+        }
 
-                    progress.update(start_len);
+        // An inner span ends before the span holding it, or at the same place but starting
+        // further on, so in this order every score a pass reads is already there.
+        std::ranges::sort(spans.begin() + 1, spans.end(), [](const Span& a, const Span& b)
+        {
+            return a.stop != b.stop ? a.stop < b.stop : a.begin > b.begin;
+        });
+        for (size_t i = 1; i < spans.size(); ++i)
+        {
+            inner_scores[key(spans[i].begin, spans[i].stop)] = best_path(spans[i], nullptr);
+        }
+        return best_path(spans.front(), steps);
+    }
 
-                    QString t_start = rule->translation_start;
-                    if (cap_next && !t_start.isEmpty())
-                    {
-                        if (t_start[0].isLower()) t_start[0] = t_start[0].toUpper();
-                        cap_next = false;
-                    }
+private:
+    // A rule found from one of a span's hits.
+    struct RuleHit
+    {
+        int from;
+        const PrefixHit* hit;
+        RuleMatch match;
+    };
 
-                    auto [text, _] = convert_recursive_plain(input.sliced(inner_start_idx, inner_len), cap_next,
-                                                             progress);
+    struct Span
+    {
+        int begin;
+        int stop;
+        std::vector<RuleHit> rules; // In the order the span's pass reaches their hits
+    };
 
-                    progress.update(end_len);
+    QStringView input;
+    const MatchLattice& lattice;
+    std::unordered_map<uint64_t, int64_t> inner_scores; // By begin in the high half, stop in the low
 
-                    if (!t_start.isEmpty())
-                    {
-                        out.text += t_start + " ";
-                    }
+    static uint64_t key(const int begin, const int stop)
+    {
+        return static_cast<uint64_t>(begin) << 32 | static_cast<uint32_t>(stop);
+    }
 
-                    out.text += text;
+    // Where the rule's inner text begins and ends.
+    static std::pair<int, int> inner_span(const RuleHit& found)
+    {
+        const int start = found.from + static_cast<int>(found.match.rule->original_start.length());
+        return {start, found.match.abs_start_of_end_token};
+    }
 
-                    if (!rule->translation_end.isEmpty())
-                    {
-                        if (!out.text.endsWith(' ')) out.text += u" ";
-                        out.text += rule->translation_end;
-                    }
+    std::vector<RuleHit> find_rules(const int begin, const int stop) const
+    {
+        const QStringView text = input.first(stop);
+        std::vector<RuleHit> found;
 
-                    i += start_len + inner_len + end_len;
-                    out.length_consumed += start_len + inner_len + end_len;
+        for (int i = begin; i < stop; ++i)
+        {
+            if (text[i].isSpace()) continue;
 
-                    if (should_append_space(input, i) && !out.text.endsWith(' '))
-                    {
-                        out.text += u" ";
-                    }
-                    continue;
+            for (const PrefixHit& hit : lattice.hits(i, stop))
+            {
+                if (hit.overlay || hit.rules == nullptr) continue;
+
+                if (const auto match = find_matching_rule<NameSetActive>(text, lattice, i, *hit.rules))
+                {
+                    found.push_back({i, &hit, *match});
                 }
             }
         }
+        return found;
+    }
 
-        if (length > 0 && priority == PHRASE)
+    int64_t best_path(const Span& span, std::vector<Step>* steps) const
+    {
+        const int begin = span.begin;
+        const int stop = span.stop;
+        const QStringView text = input.first(stop);
+        const int length = stop - begin;
+
+        std::vector<int64_t> best(length + 1, std::numeric_limits<int64_t>::min());
+        std::vector<Step> via(length + 1);
+        best[0] = 0;
+
+        // Ties keep the token found first, starting furthest back.
+        auto relax = [&](const int from, const Step& step, const int64_t score)
         {
-            if (int conflict_start = is_optimal_phrase(input, i, length); conflict_start != -1)
+            const int to = from - begin + step.length;
+            if (best[from - begin] + score > best[to])
             {
-                int max_allowed_len = conflict_start - i;
+                best[to] = best[from - begin] + score;
+                via[to] = step;
+            }
+        };
 
-                length = 0;
-                translation = nullptr;
+        auto rule = span.rules.begin();
+        for (int i = begin; i < stop; ++i)
+        {
+            if (text[i].isSpace())
+            {
+                relax(i, {Step::BLANK, 1, nullptr, {}}, 0);
+                continue;
+            }
 
-                for (int try_len = max_allowed_len; try_len >= 1; --try_len)
+            relax(i, {Step::CHARACTER, 1, nullptr, {}}, SCORE_CHARACTER);
+
+            for (const PrefixHit& hit : lattice.hits(i, stop))
+            {
+                // Name sets only ever override the dictionary's names.
+                if (hit.overlay)
                 {
-                    const auto try_string = input.sliced(i, try_len);
-                    if (current_name_set_id != -1)
-                    {
-                        if (auto [set_name, _] = name_set_dictionary.find_exact(try_string); set_name)
-                        {
-                            length = try_len;
-                            translation = set_name;
-                            break;
-                        }
-                    }
-                    auto [exact_name, exact_phrases] = dictionary.find_exact(try_string);
-                    if (exact_name)
+                    if (hit.priority == NAME)
                     {
-                        length = try_len;
-                        translation = exact_name;
-                        break;
-                    }
-                    if (exact_phrases && !exact_phrases->isEmpty())
-                    {
-                        length = try_len;
-                        translation = &exact_phrases->first();
-                        break;
+                        relax(i, {Step::WORD, hit.length, &hit, {}}, SCORE_NAME_SET * squared(hit.length));
                     }
+                    continue;
                 }
-            }
 
-            if (length == 0)
-            {
-                goto process_single_char;
+                if (hit.priority != NONE)
+                {
+                    const int64_t weight = hit.priority == NAME ? SCORE_NAME : SCORE_PHRASE;
+                    relax(i, {Step::WORD, hit.length, &hit, {}}, weight * squared(hit.length));
+                }
+
+                if (rule == span.rules.end() || rule->hit != &hit) continue;
+
+                const RuleMatch& match = rule->match;
+                const auto [inner_begin, inner_stop] = inner_span(*rule++);
+                const int64_t inner = inner_begin < inner_stop ? inner_scores.at(key(inner_begin, inner_stop)) : 0;
+                const int64_t score = SCORE_RULE
+                    * (squared(match.rule->original_start.length()) + squared(match.rule->original_end.length())) + inner;
+                relax(i, {Step::RULE, match.total_end_pos - i, nullptr, match}, score);
             }
+        }
 
-            QString trans = *translation;
-            if (cap_next)
+        if (steps)
+        {
+            steps->clear();
+            for (int at = length; at > 0; at -= via[at].length)
             {
-                if (!trans.isEmpty() && trans[0].isLower()) trans[0] = trans[0].toUpper();
-                cap_next = false;
+                steps->push_back(via[at]);
             }
+            std::ranges::reverse(*steps);
+        }
+        return best[length];
+    }
+};
 
-            out.text += trans;
-            i += length;
-            out.length_consumed += length;
+// Writes the best path through input[begin, stop), which holds no newline, and returns where it
+// got to: stop, unless cancelled first. Like the greedy engine, rules nest on an explicit stack.
+template <typename Sink, bool NameSetActive, typename Reporter>
+static int write_path(PathFinder<NameSetActive>& paths, const QStringView& input, const int begin, const int stop,
+                      Sink& sink, bool& cap_next, Reporter& progress)
+{
+    struct Frame
+    {
+        TokenWriter<Sink, Reporter> out;
+        std::vector<Step> steps;
+        size_t next = 0;
+        QString t_start; // Of the rule whose inner text the frame above writes
+    };
 
-            if (should_append_space(input, i) && !out.text.endsWith(' '))
-            {
-                out.text += u" ";
-            }
+    std::vector<Frame> frames;
+    frames.push_back({{paths.chars(), input, sink, cap_next, progress, begin}, {}, 0, {}});
+    paths.solve(begin, stop, &frames.back().steps);
 
-            progress.update(length);
+    while (true)
+    {
+        Frame& frame = frames.back();
+        TokenWriter<Sink, Reporter>& out = frame.out;
+
+        if (frame.next == frame.steps.size() || progress.stopped())
+        {
+            if (frames.size() == 1) return out.i;
 
+            frames.pop_back();
+            Frame& outer = frames.back();
+            outer.out.close_rule(outer.steps[outer.next - 1].rule, outer.t_start);
             continue;
         }
 
-    process_single_char:
-        {
-            QString translated_text;
-            bool is_punctuator = false;
+        const Step& step = frame.steps[frame.next++];
 
-            if (sv_readings.contains(ch))
+        switch (step.kind)
+        {
+        case Step::BLANK: out.blank();
+            break;
+        case Step::CHARACTER: out.character();
+            break;
+        case Step::WORD:
+            if (step.hit->priority == NAME)
             {
-                translated_text = sv_readings[ch];
+                out.name(step.length, step.hit->translation, step.hit->reading);
             }
             else
             {
-                QChar mapped = punctuations.value(ch);
-                translated_text = !mapped.isNull() ? mapped : ch;
-                static constexpr QStringView punctuators(u".!?…:;\"");
-                static constexpr QStringView comma(u",");
-                if (punctuators.contains(translated_text))
-                {
-                    cap_next = true;
-                    is_punctuator = true;
-                }
-                else if (comma.contains(translated_text))
-                {
-                    is_punctuator = true;
-                }
+                out.phrase(step.length, step.hit->translation, step.hit->reading);
             }
-
-            if (!is_punctuator && cap_next && !translated_text.isEmpty())
+            break;
+        case Step::RULE:
             {
-                if (translated_text[0].isLower()) translated_text[0] = translated_text[0].toUpper();
-                cap_next = false;
-            }
+                const int inner_start_idx = out.i + static_cast<int>(step.rule.rule->original_start.length());
+                const int inner_end_idx = step.rule.abs_start_of_end_token;
 
-            out.text += translated_text;
-            i += 1;
-            out.length_consumed += 1;
+                frame.t_start = out.open_rule(step.rule);
 
-            if (!translated_text.isEmpty() && should_append_space(input, i, ch) && !out.text.endsWith(' '))
-            {
-                out.text += u" ";
+                Frame inner{{out.chars, out.input.first(inner_end_idx), sink, cap_next, progress, inner_start_idx},
+                            {}, 0, {}};
+                paths.solve(inner_start_idx, inner_end_idx, &inner.steps);
+                frames.push_back(std::move(inner));
+                break;
             }
+        }
+    }
+}
+
+// Scores every way of cutting each paragraph into tokens and writes the best one. Rules never
+// reach across a newline here, so a span always ends exactly at stop.
+template <typename Sink, bool NameSetActive, typename Reporter>
+static int convert_optimal(const QStringView& input, const int begin, const int stop, const MatchLattice& lattice,
+                           Sink& sink, bool& cap_next, Reporter& progress)
+{
+    PathFinder<NameSetActive> paths(input, lattice);
+    TokenWriter<Sink, Reporter> out{lattice.chars(), input, sink, cap_next, progress, begin};
 
-            progress.update(1);
+    while (out.i < stop && !progress.stopped())
+    {
+        if (input[out.i] == '\n')
+        {
+            out.blank();
+            continue;
         }
+
+        const qsizetype newline = input.first(stop).indexOf('\n', out.i);
+        const int paragraph_end = newline < 0 ? stop : static_cast<int>(newline);
+        out.i = write_path<Sink>(paths, input, out.i, paragraph_end, sink, cap_next, progress);
+    }
+
+    return out.i;
+}
+
+// Converts input from begin until it reaches stop and returns where it ended up, which is past
+// stop when the last token ran over it. Positions stay absolute, so the lattice built for the
+// whole input serves every nested rule span as well.
+template <Segmentation Engine, typename Sink, bool NameSetActive, typename Reporter>
+static int convert_span(const QStringView& input, const int begin, const int stop, const MatchLattice& lattice,
+                        Sink& sink, bool& cap_next, Reporter& progress)
+{
+    if constexpr (Engine == Segmentation::Optimal)
+    {
+        return convert_optimal<Sink, NameSetActive>(input, begin, stop, lattice, sink, cap_next, progress);
+    }
+    else
+    {
+        return convert_greedy<Sink, NameSetActive>(input, begin, stop, lattice, sink, cap_next, progress);
     }
-    return out;
 }
 
-std::tuple<QString, QString, QString> convert(const QStringView& input,
-                                              const std::function<void(int)>& progress_callback)
+// Hands body whether source has a name set to read, as a compile-time constant.
+template <typename Body>
+static void with_name_set(const LatticeSource& source, Body&& body)
 {
-    QString cn_output;
-    QString sv_output;
-    QString vn_output;
+    if (source.name_set)
+    {
+        body(std::true_type{});
+    }
+    else
+    {
+        body(std::false_type{});
+    }
+}
 
-    cn_output.append(R"(<style>a{text-decoration:none;color:white;font-family:"Noto Sans SC";font-size:18px}</style>)");
-    sv_output.append(R"(<style>a{text-decoration:none;color:white;font-family:"Tahoma";font-size:16px}</style>)");
-    vn_output.append(R"(<style>a{text-decoration:none;color:white;font-family:"Tahoma";font-size:16px;}</style>)");
+// Hands body the engine picked at runtime as a compile-time constant.
+template <typename Body>
+static auto with_engine(const Segmentation segmentation, Body&& body)
+{
+    if (segmentation == Segmentation::Optimal)
+    {
+        return body(std::integral_constant<Segmentation, Segmentation::Optimal>{});
+    }
+    return body(std::integral_constant<Segmentation, Segmentation::Greedy>{});
+}
 
-    int token_counter = 0;
+// Returns false if the conversion was cancelled before it finished.
+template <Segmentation Engine, typename Sink>
+static bool run_converter(const QStringView& input, const LatticeSource& source, Sink& sink,
+                          const std::function<void(int)>& progress_callback, const std::stop_token& cancel)
+{
     bool cap_next = true;
+    Progress progress(progress_callback, cancel);
+    const MatchLattice lattice(source, input, 0, static_cast<int>(input.length()));
+
+    with_name_set(source, [&](auto name_set_active)
+    {
+        constexpr bool NameSetActive = decltype(name_set_active)::value;
+        convert_span<Engine, Sink, NameSetActive>(input, 0, static_cast<int>(input.length()), lattice, sink,
+                                                  cap_next, progress);
+    });
 
-    Progress progress(progress_callback);
+    return !progress.stopped();
+}
 
-    const ConversionResult res = convert_recursive(input, 0, token_counter, cap_next, progress);
+// Converts input[begin, end), where end is either the end of the input or just past a newline.
+// Returns end if that newline came out as a token of its own, which leaves the converter in the
+// same state it starts a document in; anything further on means a rule ran across it.
+template <Segmentation Engine, bool NameSetActive, typename Reporter>
+static int convert_paragraphs(const QStringView& input, const int begin, const int end, const MatchLattice& lattice,
+                              PlainSink& sink, bool& cap_next, Reporter& progress)
+{
+    if (input[end - 1] != '\n')
+    {
+        return convert_span<Engine, PlainSink, NameSetActive>(input, begin, end, lattice, sink, cap_next, progress);
+    }
 
-    cn_output.append(res.cn);
-    sv_output.append(res.sv);
-    vn_output.append(res.vn);
+    const int stopped = convert_span<Engine, PlainSink, NameSetActive>(input, begin, end - 1, lattice, sink,
+                                                                       cap_next, progress);
+    if (stopped != end - 1) return stopped;
 
-    return {cn_output, sv_output, vn_output};
+    return convert_span<Engine, PlainSink, NameSetActive>(input, stopped, end, lattice, sink, cap_next, progress);
 }
 
-QString convert_plain(const QStringView& input, const std::function<void(int)>& progress_callback)
+// Large inputs are cut into runs of paragraphs that are converted on the thread pool, each as
+// if it started a document. A run's output is only used when the previous one ended cleanly on
+// its final newline; otherwise the converter carries on serially from wherever that run
+// stopped until it is back in step, so the result is identical to converting in one pass.
+// Every run gets a lattice of its own, built and dropped by the worker converting it, so only
+// the runs in flight hold one however long the input is.
+template <Segmentation Engine>
+static QString convert_plain_parallel(const QStringView& input, const LatticeSource& source,
+                                      const std::function<void(int)>& progress_callback,
+                                      const std::stop_token& cancel)
 {
-    bool cap_next = true;
-    Progress progress(progress_callback);
-    auto [text, _] = convert_recursive_plain(input, cap_next, progress);
-    return text.trimmed();
+    struct Chunk
+    {
+        int begin;
+        int end;
+        PlainSink sink;
+        bool cap_next = true;
+        int stopped = 0;
+    };
+
+    const int length = static_cast<int>(input.length());
+
+    std::vector<Chunk> chunks;
+    for (int begin = 0; begin < length;)
+    {
+        const int target_end = begin + PARALLEL_CHUNK_SIZE;
+        const qsizetype cutoff = target_end < length ? input.indexOf('\n', target_end) : -1;
+        const int end = cutoff == -1 ? length : static_cast<int>(cutoff) + 1;
+        chunks.push_back({begin, end, {}});
+        begin = end;
+    }
+
+    SharedProgress progress(progress_callback, cancel);
+    PlainSink output;
+
+    // A run's tokens all start inside it; past its end, only a rule that runs over it looks.
+    auto lattice_for = [&](const int begin, const int end)
+    {
+        return MatchLattice(source, input, begin, std::min(end + RULE_WINDOW, length));
+    };
+
+    auto run = [&](auto name_set_active)
+    {
+        constexpr bool NameSetActive = decltype(name_set_active)::value;
+
+        QtConcurrent::blockingMap(chunks, [&](Chunk& chunk)
+        {
+            if (progress.stopped()) return;
+
+            const MatchLattice lattice = lattice_for(chunk.begin, chunk.end);
+            chunk.stopped = convert_paragraphs<Engine, NameSetActive>(input, chunk.begin, chunk.end, lattice,
+                                                                      chunk.sink, chunk.cap_next, progress);
+        });
+        if (progress.stopped()) return;
+
+        // Progress for anything redone here was already counted by the chunk that ran first.
+        QuietProgress quiet{cancel};
+        bool cap_next = true;
+        int pos = 0;
+
+        for (Chunk& chunk : chunks)
+        {
+            if (pos >= chunk.end) continue;
+            if (quiet.stopped()) return;
+
+            if (pos == chunk.begin && cap_next && !output.ends_with_space())
+            {
+                output.append(chunk.sink);
+                cap_next = chunk.cap_next;
+                pos = chunk.stopped;
+            }
+            else
+            {
+                const MatchLattice lattice = lattice_for(pos, chunk.end);
+                pos = convert_paragraphs<Engine, NameSetActive>(input, pos, chunk.end, lattice, output, cap_next,
+                                                                quiet);
+            }
+        }
+    };
+
+    with_name_set(source, run);
+
+    if (progress.stopped() || cancel.stop_requested()) return {};
+    return output.finish();
+}
+
+std::tuple<QString, QString, QString> convert(const QStringView& input, const LatticeSource& source,
+                                              const std::function<void(int)>& progress_callback,
+                                              const std::stop_token cancel, const Segmentation segmentation)
+{
+    HtmlSink sink(input.length(), *source.chars);
+    const bool finished = with_engine(segmentation, [&](auto engine)
+    {
+        return run_converter<decltype(engine)::value>(input, source, sink, progress_callback, cancel);
+    });
+    if (!finished) return {};
+    return sink.finish();
+}
+
+QString convert_plain(const QStringView& input, const LatticeSource& source,
+                      const std::function<void(int)>& progress_callback, const std::stop_token cancel,
+                      const Segmentation segmentation)
+{
+    if (input.length() < PARALLEL_THRESHOLD)
+    {
+        return convert_plain_serial(input, source, progress_callback, cancel, segmentation);
+    }
+
+    return with_engine(segmentation, [&](auto engine)
+    {
+        return convert_plain_parallel<decltype(engine)::value>(input, source, progress_callback, cancel);
+    });
+}
+
+QString convert_plain_serial(const QStringView& input, const LatticeSource& source,
+                             const std::function<void(int)>& progress_callback, const std::stop_token cancel,
+                             const Segmentation segmentation)
+{
+    PlainSink sink;
+    const bool finished = with_engine(segmentation, [&](auto engine)
+    {
+        return run_converter<decltype(engine)::value>(input, source, sink, progress_callback, cancel);
+    });
+    if (!finished) return {};
+    return sink.finish();
 }
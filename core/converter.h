@@ -2,6 +2,24 @@
 #include <QString>
 #include <tuple>
 #include <functional>
+#include <stop_token>
 
-std::tuple<QString, QString, QString> convert(const QStringView& input, const std::function<void(int)>& progress_callback = nullptr);
-QString convert_plain(const QStringView& input, const std::function<void(int)>& progress_callback = nullptr);
\ No newline at end of file
+#include "lattice.h"
+
+// How the text is cut into tokens. Greedy takes the longest match at each position, with
+// heuristics for names and phrases that run into each other. Optimal scores every way of
+// cutting a paragraph into the dictionary's matches and writes the best one.
+enum class Segmentation
+{
+    Greedy,
+    Optimal
+};
+
+// Both read the dictionaries through source, pinned by the caller on the thread that edits
+// them, and return empty output when cancel is requested before the conversion finishes;
+// it is checked whenever progress is reported.
+std::tuple<QString, QString, QString> convert(const QStringView& input, const LatticeSource& source, const std::function<void(int)>& progress_callback = nullptr, std::stop_token cancel = {}, Segmentation segmentation = Segmentation::Greedy);
+QString convert_plain(const QStringView& input, const LatticeSource& source, const std::function<void(int)>& progress_callback = nullptr, std::stop_token cancel = {}, Segmentation segmentation = Segmentation::Greedy);
+// convert_plain() on the calling thread alone, however long the input: what splitting it
+// across threads has to reproduce.
+QString convert_plain_serial(const QStringView& input, const LatticeSource& source, const std::function<void(int)>& progress_callback = nullptr, std::stop_token cancel = {}, Segmentation segmentation = Segmentation::Greedy);
\ No newline at end of file
@@ -0,0 +1,526 @@
+#include "datrie.h"
+#include "chartable.h"
+
+#include <QFile>
+#include <QHash>
+#include <QSaveFile>
+#include <algorithm>
+#include <ranges>
+
+static constexpr size_t ALPHABET_SIZE = 65536;
+
+// Characters that label many edges get the smallest codes, so sibling sets cluster
+// at the low end of the array and pack densely.
+static std::vector<uint16_t> build_code_map(const TrieNode* root)
+{
+    std::vector<uint32_t> counts(ALPHABET_SIZE, 0);
+    std::vector<const TrieNode*> stack{root};
+
+    while (!stack.empty()) {
+        const TrieNode* node = stack.back();
+        stack.pop_back();
+
+        for (const auto& [ch, child] : node->children()) {
+            counts[ch.unicode()]++;
+            stack.push_back(child);
+        }
+    }
+
+    std::vector<uint16_t> order;
+    for (size_t c = 0; c < ALPHABET_SIZE; ++c) {
+        if (counts[c]) order.push_back(static_cast<uint16_t>(c));
+    }
+    std::ranges::stable_sort(order, [&](const uint16_t a, const uint16_t b) {
+        return counts[a] > counts[b];
+    });
+
+    std::vector<uint16_t> code_map(ALPHABET_SIZE, 0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        code_map[order[i]] = static_cast<uint16_t>(i + 1);
+    }
+    return code_map;
+}
+
+namespace {
+    // Owns the arrays of a trie built in memory; a mapped snapshot owns them otherwise.
+    struct Storage {
+        std::vector<uint16_t> code_map;
+        std::vector<DoubleArrayTrie::Unit> units;
+        std::vector<DoubleArrayTrie::Payload> payloads;
+        std::vector<char16_t> text_pool;
+    };
+}
+
+DoubleArrayTrie DoubleArrayTrie::build(const TrieNode* root, const CharTable& chars,
+                                       const LayoutProfile* profile)
+{
+    auto storage = std::make_shared<Storage>();
+    auto& [code_map, units, payloads, text_pool] = *storage;
+    std::vector<RuleSet> rule_groups;
+
+    code_map = build_code_map(root);
+    const auto alphabet = static_cast<size_t>(*std::ranges::max_element(code_map));
+
+    // Group 0 is shared by every node that carries an empty rule list, which still has to
+    // shadow shorter rule starts exactly like the pointer trie does.
+    rule_groups.emplace_back();
+
+    // The arena already keeps one copy of each string, so its handles identify them.
+    QHash<StringArena::Handle, uint32_t> interned;
+    auto intern = [&](const StringArena::Handle handle) {
+        if (const auto it = interned.constFind(handle); it != interned.cend()) return it.value();
+
+        const QStringView value = StringArena::view(handle);
+        const auto offset = static_cast<uint32_t>(text_pool.size());
+        text_pool.insert(text_pool.end(), value.utf16(), value.utf16() + value.size());
+        interned.insert(handle, offset);
+        return offset;
+    };
+
+    std::vector<char16_t> labels(ALPHABET_SIZE, 0);
+    for (size_t c = 0; c < ALPHABET_SIZE; ++c) {
+        if (code_map[c]) labels[code_map[c]] = static_cast<char16_t>(c);
+    }
+
+    // Keys are short, so a node's key is recovered by following check[] back to the root
+    // rather than carried along for every node in the queue.
+    QString key;
+    auto append_reading = [&](Payload& payload, int32_t state) {
+        key.clear();
+        while (state != 0) {
+            const int32_t parent = units[state].check;
+            key.prepend(QChar(labels[state - units[parent].base]));
+            state = parent;
+        }
+
+        payload.reading_offset = static_cast<uint32_t>(text_pool.size());
+        for (qsizetype i = 0; i < key.size(); ++i) {
+            if (i) text_pool.push_back(u' ');
+            const QStringView reading = chars.reading_or_normalized(chars[key[i]]);
+            text_pool.insert(text_pool.end(), reading.utf16(), reading.utf16() + reading.size());
+        }
+        payload.reading_length = static_cast<uint32_t>(text_pool.size() - payload.reading_offset);
+    };
+
+    auto attach_payload = [&](const TrieNode* node, const int32_t state) -> int32_t {
+        const StringArena::Handle name = node->get_name();
+        const StringArena::Handle phrases = node->get_phrases();
+        const RuleSet* rules = node->get_rules();
+
+        if (!name && !phrases && !rules) return -1;
+
+        Payload payload;
+        if (name) {
+            payload.name_offset = intern(name);
+            payload.name_length = static_cast<uint32_t>(StringArena::view(name).size());
+        }
+        if (phrases) {
+            const QStringView list = StringArena::view(phrases);
+            const qsizetype separator = list.indexOf(QChar('\x1F'));
+            payload.phrases_offset = intern(phrases);
+            payload.phrases_length = static_cast<uint32_t>(list.size());
+            payload.first_phrase_length = static_cast<uint32_t>(separator < 0 ? list.size() : separator);
+        }
+        if (name || phrases) {
+            append_reading(payload, state);
+        }
+        if (rules) {
+            if (rules->empty()) {
+                payload.rules = 0;
+            } else {
+                payload.rules = static_cast<int32_t>(rule_groups.size());
+                rule_groups.push_back(*rules);
+            }
+        }
+
+        payloads.push_back(payload);
+        return static_cast<int32_t>(payloads.size() - 1);
+    };
+
+    std::vector<uint8_t> used;
+    auto reserve_units = [&](const size_t count) {
+        if (units.size() < count) {
+            const size_t grown = std::max(count, units.size() * 2);
+            units.resize(grown);
+            used.resize(grown, 0);
+        }
+    };
+
+    size_t next_check_pos = 1;
+    auto find_base = [&](const std::vector<std::pair<uint16_t, const TrieNode*>>& children) {
+        const size_t first_code = children.front().first;
+        size_t pos = std::max(first_code + 1, next_check_pos) - 1;
+        size_t occupied = 0;
+        bool first_free = true;
+
+        while (true) {
+            ++pos;
+            reserve_units(pos + 1);
+
+            if (used[pos]) {
+                ++occupied;
+                continue;
+            }
+            if (first_free) {
+                next_check_pos = pos;
+                first_free = false;
+            }
+
+            const size_t base = pos - first_code;
+            reserve_units(base + children.back().first + 1);
+
+            if (std::ranges::any_of(children, [&](const auto& child) { return used[base + child.first]; })) {
+                continue;
+            }
+
+            // Once the scanned window is almost full, stop rescanning it for later nodes.
+            if (occupied * 20 >= (pos - next_check_pos + 1) * 19) {
+                next_check_pos = pos;
+            }
+            return base;
+        }
+    };
+
+    struct Pending {
+        const TrieNode* node;
+        int32_t state;
+        uint32_t visits;
+        QString key; // Only kept for visited states; nothing under the others was visited.
+    };
+
+    reserve_units(1);
+    used[0] = 1;
+    units[0].payload = attach_payload(root, 0);
+
+    // Visited states are laid out first, hottest first, while the free space is still at
+    // the front, so their children end up packed together. A state is never visited more
+    // often than its parent, so parents still go before their children. Everything else
+    // follows in breadth-first order, which is all there is without a profile.
+    const bool profiled = profile && !profile->empty();
+    const auto cooler = [](const Pending& a, const Pending& b) { return a.visits < b.visits; };
+    std::vector<Pending> hot;
+    std::vector<Pending> queue;
+    if (profiled) {
+        hot.push_back({root, 0, UINT32_MAX, {}});
+    } else {
+        queue.push_back({root, 0, 0, {}});
+    }
+
+    size_t max_base = 0;
+    size_t head = 0;
+    std::vector<std::pair<uint16_t, const TrieNode*>> children;
+
+    while (!hot.empty() || head < queue.size()) {
+        Pending current{};
+        if (!hot.empty()) {
+            std::ranges::pop_heap(hot, cooler);
+            current = std::move(hot.back());
+            hot.pop_back();
+        } else {
+            current = queue[head++];
+        }
+        const auto& [node, state, visits, node_key] = current;
+
+        children.clear();
+        for (const auto& [ch, child] : node->children()) {
+            children.emplace_back(code_map[ch.unicode()], child);
+        }
+        if (children.empty()) continue;
+
+        std::ranges::sort(children, {}, &std::pair<uint16_t, const TrieNode*>::first);
+
+        const size_t base = find_base(children);
+        max_base = std::max(max_base, base);
+        units[state].base = static_cast<int32_t>(base);
+
+        for (const auto& [code, child] : children) {
+            const auto next = static_cast<int32_t>(base + code);
+            used[next] = 1;
+            units[next].check = state;
+            units[next].payload = attach_payload(child, next);
+
+            if (visits) {
+                QString child_key = node_key + QChar(labels[code]);
+                if (const uint32_t child_visits = profile->visits(child_key)) {
+                    hot.push_back({child, next, child_visits, std::move(child_key)});
+                    std::ranges::push_heap(hot, cooler);
+                    continue;
+                }
+            }
+            queue.push_back({child, next, 0, {}});
+        }
+    }
+
+    // Pad so that base + code never leaves the array; find() then needs no bounds check.
+    units.resize(max_base + alphabet + 1);
+    units.shrink_to_fit();
+    payloads.shrink_to_fit();
+    text_pool.shrink_to_fit();
+
+    const Image image{code_map, units, payloads, text_pool};
+    return adopt(image, std::move(rule_groups), std::move(storage));
+}
+
+DoubleArrayTrie DoubleArrayTrie::adopt(const Image& image, std::vector<RuleSet> rule_groups,
+                                       std::shared_ptr<const void> owner)
+{
+    DoubleArrayTrie trie;
+    trie.data = image;
+    trie.rule_groups = std::move(rule_groups);
+    trie.owner = std::move(owner);
+    return trie;
+}
+
+size_t DoubleArrayTrie::byte_size() const
+{
+    size_t bytes = data.code_map.size_bytes() + data.units.size_bytes() + data.payloads.size_bytes()
+        + data.text_pool.size_bytes();
+    for (const auto& group : rule_groups) {
+        bytes += group.byte_size();
+    }
+    return bytes;
+}
+
+Match DoubleArrayTrie::find(const QStringView& text, const int startPos) const
+{
+    const Unit* unit = data.units.data();
+    const uint16_t* codes = data.code_map.data();
+
+    int32_t state = 0;
+    int best_len_found = 0;
+    QStringView translated;
+    QStringView reading;
+    Priority priority = NONE;
+    const RuleSet* rules = nullptr;
+
+    for (int i = startPos; i < text.length(); ++i) {
+        const uint16_t code = codes[text[i].unicode()];
+        if (!code) break;
+
+        const int32_t next = unit[state].base + code;
+        if (unit[next].check != state) break;
+        state = next;
+
+        const int32_t payload_index = unit[state].payload;
+        if (payload_index < 0) continue;
+
+        const Payload& payload = data.payloads[payload_index];
+
+        if (payload.rules >= 0) {
+            rules = &rule_groups[payload.rules];
+        }
+
+        if (payload.name_offset != NO_TEXT) {
+            best_len_found = i - startPos + 1;
+            translated = this->text(payload.name_offset, payload.name_length);
+            reading = this->text(payload.reading_offset, payload.reading_length);
+            priority = NAME;
+        }
+        else if (payload.phrases_offset != NO_TEXT) {
+            if ((i - startPos + 1) > best_len_found) {
+                best_len_found = i - startPos + 1;
+                translated = this->text(payload.phrases_offset, payload.first_phrase_length);
+                reading = this->text(payload.reading_offset, payload.reading_length);
+                priority = PHRASE;
+            }
+        }
+    }
+
+    return {best_len_found, priority, rules, translated, reading};
+}
+
+void DoubleArrayTrie::find_prefixes(const QStringView& text, const int startPos, std::vector<PrefixHit>& hits) const
+{
+    int32_t state = 0;
+    for (int i = startPos; i < text.length(); ++i) {
+        state = step(state, text[i]);
+        if (state < 0) break;
+
+        if (PrefixHit found; hit(state, i - startPos + 1, found)) {
+            hits.push_back(found);
+        }
+    }
+}
+
+bool DoubleArrayTrie::hit(const int32_t state, const int length, PrefixHit& hit) const
+{
+    const int32_t payload_index = data.units[state].payload;
+    if (payload_index < 0) return false;
+
+    const Payload& payload = data.payloads[payload_index];
+    hit = {length, NONE, nullptr, {}, {}};
+
+    if (payload.rules >= 0) {
+        hit.rules = &rule_groups[payload.rules];
+    }
+    if (payload.name_offset != NO_TEXT) {
+        hit.priority = NAME;
+        hit.translation = this->text(payload.name_offset, payload.name_length);
+        hit.reading = this->text(payload.reading_offset, payload.reading_length);
+    }
+    else if (payload.phrases_offset != NO_TEXT) {
+        hit.priority = PHRASE;
+        hit.translation = this->text(payload.phrases_offset, payload.first_phrase_length);
+        hit.reading = this->text(payload.reading_offset, payload.reading_length);
+    }
+    return true;
+}
+
+Entry DoubleArrayTrie::entry(const int32_t payload_index) const
+{
+    Entry result;
+    if (payload_index < 0) return result;
+
+    const Payload& payload = data.payloads[payload_index];
+    if (payload.name_offset != NO_TEXT) {
+        result.name = text(payload.name_offset, payload.name_length);
+    }
+    if (payload.phrases_offset != NO_TEXT) {
+        result.phrases = text(payload.phrases_offset, payload.phrases_length);
+    }
+    if (payload.rules >= 0) {
+        result.rules = &rule_groups[payload.rules];
+    }
+    return result;
+}
+
+Entry DoubleArrayTrie::find_exact(const QStringView& key) const
+{
+    if (data.units.empty()) return {};
+
+    int32_t state = 0;
+    for (const QChar ch : key) {
+        const uint16_t code = data.code_map[ch.unicode()];
+        if (!code) return {};
+
+        const int32_t next = data.units[state].base + code;
+        if (data.units[next].check != state) return {};
+        state = next;
+    }
+    return entry(data.units[state].payload);
+}
+
+DoubleArrayTrie::Edges DoubleArrayTrie::edges() const
+{
+    const auto& units = data.units;
+    Edges edges;
+    edges.first.assign(units.size() + 1, 0);
+
+    // The image only records parent links, so gather each state's children in one pass
+    // over check[] instead of probing every code from every state.
+    for (size_t t = 1; t < units.size(); ++t) {
+        if (units[t].check >= 0) edges.first[units[t].check + 1]++;
+    }
+    for (size_t s = 1; s < edges.first.size(); ++s) {
+        edges.first[s] += edges.first[s - 1];
+    }
+
+    std::vector<char16_t> labels(ALPHABET_SIZE, 0);
+    for (size_t c = 0; c < ALPHABET_SIZE; ++c) {
+        if (data.code_map[c]) labels[data.code_map[c]] = static_cast<char16_t>(c);
+    }
+
+    edges.children.resize(edges.first.back());
+    std::vector<uint32_t> cursor(edges.first.begin(), edges.first.end() - 1);
+    for (size_t t = 1; t < units.size(); ++t) {
+        if (const int32_t parent = units[t].check; parent >= 0) {
+            const auto label = labels[static_cast<int32_t>(t) - units[parent].base];
+            edges.children[cursor[parent]++] = {label, static_cast<int32_t>(t)};
+        }
+    }
+
+    // Codes follow how often a character occurs, not the character itself.
+    for (size_t s = 0; s + 1 < edges.first.size(); ++s) {
+        std::ranges::sort(std::span(edges.children).subspan(edges.first[s], edges.first[s + 1] - edges.first[s]));
+    }
+    return edges;
+}
+
+void DoubleArrayTrie::for_each_entry(const std::function<void(const QString&, const Entry&)>& visit) const
+{
+    if (data.units.empty()) return;
+    const Edges edges = this->edges();
+
+    QString key;
+    auto walk = [&](auto&& self, const int32_t state) -> void {
+        if (data.units[state].payload >= 0) {
+            visit(key, entry(data.units[state].payload));
+        }
+        for (uint32_t i = edges.first[state]; i < edges.first[state + 1]; ++i) {
+            const auto [label, child] = edges.children[i];
+            key.append(QChar(label));
+            self(self, child);
+            key.chop(1);
+        }
+    };
+    walk(walk, 0);
+}
+
+void LayoutProfile::record(const DoubleArrayTrie& trie, const QStringView text)
+{
+    QString key;
+    for (qsizetype start = 0; start < text.size(); ++start) {
+        key.clear();
+        int32_t state = 0;
+        for (qsizetype i = start; i < text.size(); ++i) {
+            state = trie.step(state, text[i]);
+            if (state < 0) break;
+
+            key.append(text[i]);
+            ++counts[key];
+        }
+    }
+}
+
+bool LayoutProfile::save(const QString& path) const
+{
+    std::vector<std::pair<uint32_t, QString>> hottest;
+    hottest.reserve(counts.size());
+    for (auto it = counts.cbegin(); it != counts.cend(); ++it) {
+        hottest.emplace_back(it.value(), it.key());
+    }
+
+    // On equal counts the shorter prefix goes first, so cutting the list never keeps a
+    // prefix without the ones leading up to it.
+    std::ranges::sort(hottest, [](const auto& a, const auto& b) {
+        if (a.first != b.first) return a.first > b.first;
+        return a.second.size() < b.second.size();
+    });
+    if (hottest.size() > static_cast<size_t>(MAX_PREFIXES)) {
+        hottest.resize(MAX_PREFIXES);
+    }
+
+    QByteArray out;
+    for (const auto& [count, prefix] : hottest) {
+        out += QByteArray::number(count);
+        out += '\t';
+        out += prefix.toUtf8();
+        out += '\n';
+    }
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) return false;
+    if (file.write(out) != out.size()) {
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
+}
+
+LayoutProfile LayoutProfile::load(const QString& path)
+{
+    LayoutProfile profile;
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) return profile;
+
+    for (const QByteArray& line : file.readAll().split('\n')) {
+        const qsizetype tab = line.indexOf('\t');
+        if (tab <= 0) continue;
+
+        bool ok = false;
+        const uint32_t count = line.first(tab).toUInt(&ok);
+        if (ok && count) profile.counts.insert(QString::fromUtf8(line.sliced(tab + 1)), count);
+    }
+    return profile;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QStringView>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "structures.h"
+
+// How often converting a sample of text stepped onto each key prefix.
+class LayoutProfile {
+public:
+    // Only the hottest prefixes are saved.
+    static constexpr qsizetype MAX_PREFIXES = 1 << 16;
+
+    // Walks text from every position, as the converter's lattice does, counting each step.
+    void record(const DoubleArrayTrie& trie, QStringView text);
+    [[nodiscard]] uint32_t visits(const QString& prefix) const { return counts.value(prefix); }
+    [[nodiscard]] bool empty() const { return counts.isEmpty(); }
+
+    // One "count<TAB>prefix" line per prefix, hottest first.
+    bool save(const QString& path) const;
+    // Empty when there is no file, so callers can always pass the result on.
+    static LayoutProfile load(const QString& path);
+
+private:
+    QHash<QString, uint32_t> counts;
+};
+
+// Frozen, read-only double-array (base/check) image of a Dictionary trie.
+// A transition from state s on character ch lands on units[units[s].base + code_map[ch]]
+// and is valid only when that unit's check equals s, so every step is a single array access.
+class DoubleArrayTrie {
+public:
+    static constexpr uint32_t NO_TEXT = UINT32_MAX;
+
+    struct Unit {
+        int32_t base = 0;
+        int32_t check = -1;
+        int32_t payload = -1;
+    };
+
+    struct Payload {
+        uint32_t name_offset = NO_TEXT;
+        uint32_t name_length = 0;
+        uint32_t phrases_offset = NO_TEXT; // Every phrase, joined by \x1F as stored in the database.
+        uint32_t phrases_length = 0;
+        uint32_t first_phrase_length = 0;
+        int32_t rules = -1;
+        uint32_t reading_offset = NO_TEXT; // Sino-Vietnamese reading of the key, for names and phrases.
+        uint32_t reading_length = 0;
+    };
+
+    // Everything but the rules is plain, position-independent data, so it can be
+    // written to a snapshot as is and used straight from a mapping.
+    struct Image {
+        std::span<const uint16_t> code_map;
+        std::span<const Unit> units;
+        std::span<const Payload> payloads;
+        std::span<const char16_t> text_pool;
+    };
+
+    // Readings of every name and phrase key are taken from chars and stored with the entry.
+    // With a profile, the states it saw visited are placed first, hottest first.
+    static DoubleArrayTrie build(const TrieNode* root, const CharTable& chars,
+                                 const LayoutProfile* profile = nullptr);
+    static DoubleArrayTrie adopt(const Image& image, std::vector<RuleSet> rule_groups,
+                                 std::shared_ptr<const void> owner);
+
+    [[nodiscard]] Match find(const QStringView& text, int startPos) const;
+    void find_prefixes(const QStringView& text, int startPos, std::vector<PrefixHit>& hits) const;
+    [[nodiscard]] Entry find_exact(const QStringView& key) const;
+    void for_each_entry(const std::function<void(const QString&, const Entry&)>& visit) const;
+
+    // Every state's children in character order: state s's are children[first[s]] up to
+    // children[first[s + 1]], each with the character leading to it.
+    struct Edges {
+        std::vector<uint32_t> first;
+        std::vector<std::pair<char16_t, int32_t>> children;
+    };
+    [[nodiscard]] Edges edges() const;
+    // What the key leading to state holds.
+    [[nodiscard]] Entry entry_at(const int32_t state) const { return entry(data.units[state].payload); }
+
+    // Single steps of the find_prefixes() walk, for walking several tries side by side.
+    // The walk starts at state 0; step() gives -1 once no key continues with ch.
+    [[nodiscard]] int32_t step(const int32_t state, const QChar ch) const {
+        const uint16_t code = data.code_map[ch.unicode()];
+        if (!code) return -1;
+
+        const int32_t next = data.units[state].base + code;
+        return data.units[next].check == state ? next : -1;
+    }
+    // Fills hit from the entry at state, if the key leading there has one.
+    bool hit(int32_t state, int length, PrefixHit& hit) const;
+
+    [[nodiscard]] const Image& image() const { return data; }
+    // Bytes of the arrays and rules, whether they are owned or mapped.
+    [[nodiscard]] size_t byte_size() const;
+    [[nodiscard]] const std::vector<RuleSet>& rules() const { return rule_groups; }
+
+private:
+    Image data;
+    std::vector<RuleSet> rule_groups;
+    std::shared_ptr<const void> owner;
+
+    [[nodiscard]] QStringView text(uint32_t offset, uint32_t length) const {
+        return {data.text_pool.data() + offset, static_cast<qsizetype>(length)};
+    }
+    [[nodiscard]] Entry entry(int32_t payload_index) const;
+};
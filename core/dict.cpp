@@ -1,9 +1,89 @@
+#include <QCoreApplication>
 #include <QSqlQuery>
+#include <QThread>
 #include <QtConcurrent>
+#include <set>
+#include <unordered_map>
 
+#include "datrie.h"
 #include "dict.h"
+#include "snapshot.h"
 #include "structures.h"
 
+static std::shared_ptr<const Snapshot> snapshot;
+// Entries of every name set used so far, so each one is only read from storage once.
+static std::unordered_map<int, QHash<QString, QString>> name_set_cache;
+// Last change_log version the data in memory reflects, or -1 before anything is loaded.
+static qint64 loaded_version = -1;
+// Written by train_layout(); read whenever the snapshot has to be rebuilt.
+static constexpr auto LAYOUT_PROFILE = "layout.profile";
+// Bumped by every reload, so background work started before one knows to stand down.
+static int reload_count = 0;
+
+// Tables whose edits go to change_log, with the columns that identify a row.
+struct JournaledTable
+{
+    const char* name;
+    const char* key;
+    const char* scope;
+};
+
+static constexpr JournaledTable JOURNALED_TABLES[] = {
+    {"names", "original", nullptr},
+    {"phrases", "original", nullptr},
+    {"grammar_rules", "original_start", "original_end"},
+    {"name_set_entries", "original", "set_id"},
+    {"name_sets", "id", nullptr},
+    {"sv_readings", "original", nullptr},
+    {"punctuations", "original", nullptr},
+};
+
+// One row of names, phrases or grammar_rules, waiting to be sorted into its shard's trie.
+struct LoadedRow
+{
+    QString key;
+    Priority priority; // NONE for a grammar rule.
+    QString value;
+    Rule rule;
+};
+
+// Keeps a journal of every row any writer (this program, or a script) touches, so a
+// reload only has to read those rows again.
+static void init_journal(const QSqlDatabase& db)
+{
+    QSqlQuery query(db);
+    query.exec(R"(CREATE TABLE IF NOT EXISTS change_log (
+                      version INTEGER PRIMARY KEY AUTOINCREMENT,
+                      source TEXT NOT NULL,
+                      original TEXT NOT NULL,
+                      scope TEXT))");
+
+    for (const auto& table : JOURNALED_TABLES)
+    {
+        const QString name(table.name);
+        const auto log = [&](const QString& row)
+        {
+            const QString scope = table.scope ? row + "." + table.scope : QString("NULL");
+            return "INSERT INTO change_log (source, original, scope) VALUES ('" + name + "', "
+                + row + "." + table.key + ", " + scope + ");";
+        };
+
+        query.exec("CREATE TRIGGER IF NOT EXISTS " + name + "_log_insert AFTER INSERT ON " + name
+            + " BEGIN " + log("NEW") + " END");
+        query.exec("CREATE TRIGGER IF NOT EXISTS " + name + "_log_update AFTER UPDATE ON " + name
+            + " BEGIN " + log("OLD") + " " + log("NEW") + " END");
+        query.exec("CREATE TRIGGER IF NOT EXISTS " + name + "_log_delete AFTER DELETE ON " + name
+            + " BEGIN " + log("OLD") + " END");
+    }
+}
+
+static qint64 journal_head()
+{
+    QSqlQuery query;
+    query.exec("SELECT seq FROM sqlite_sequence WHERE name = 'change_log'");
+    return query.next() ? query.value(0).toLongLong() : 0;
+}
+
 void init_db()
 {
     auto db = QSqlDatabase::addDatabase("QSQLITE");
@@ -16,11 +96,40 @@ void init_db()
 
     QSqlQuery query(db);
     query.exec("PRAGMA foreign_keys = ON;");
-    query.exec("VACUUM;");
+    init_journal(db);
+}
+
+std::vector<NameSetEntry> read_name_set_entries()
+{
+    // Named per thread: a snapshot rewritten after a reload reads this while a full load may too.
+    const QString connection = "NS_thread_" + QString::number(reinterpret_cast<quintptr>(QThread::currentThreadId()));
+    std::vector<NameSetEntry> entries;
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connection);
+        db.setDatabaseName("dict.db");
+        if (db.open())
+        {
+            QSqlQuery query(db);
+            query.setForwardOnly(true);
+            query.exec("SELECT set_id, original, translated FROM name_set_entries");
+            while (query.next())
+            {
+                entries.emplace_back(query.value(0).toInt(), query.value(1).toString(), query.value(2).toString());
+            }
+            db.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(connection);
+    return entries;
 }
 
 void load_global_data(const std::function<void()>& on_finished)
 {
+    const DbFingerprint source = db_fingerprint("dict.db");
+    // Anything logged from here on may or may not make it into what is read below;
+    // replaying it later is harmless.
+    loaded_version = journal_head();
+
     QFuture<void> future_sv = QtConcurrent::run([]
     {
         {
@@ -65,45 +174,103 @@ void load_global_data(const std::function<void()>& on_finished)
         QSqlDatabase::removeDatabase("P_thread");
     });
 
-    QFuture<void> future_trie = QtConcurrent::run([]
+    // Keys are split between shards by their first UTF-16 unit, so every shard builds its own
+    // part of the trie on its own connection, and the parts are grafted under one root after.
+    // Each shard sorts its rows first and builds its part bottom-up.
+    const int shard_count = std::max(1, QThread::idealThreadCount());
+    auto parts = std::make_shared<std::vector<Dictionary>>(shard_count);
+
+    QList<QFuture<void>> future_shards;
+    for (int shard = 0; shard < shard_count; ++shard)
     {
+        future_shards.append(QtConcurrent::run([parts, shard, shard_count]
         {
-            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "NP_thread");
-            db.setDatabaseName("dict.db");
-            if (db.open())
+            const QString connection = "NP_thread_" + QString::number(shard);
             {
-                QSqlQuery query(db);
-                query.setForwardOnly(true);
-
-                query.exec("SELECT original, translated FROM names");
-                while (query.next())
+                QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connection);
+                db.setDatabaseName("dict.db");
+                if (db.open())
                 {
-                    dictionary.insert_bulk(query.value(0).toString(), NAME, query.value(1).toString());
-                }
+                    std::vector<LoadedRow> rows;
+                    QSqlQuery query(db);
+                    query.setForwardOnly(true);
 
-                query.exec("SELECT original, translated FROM phrases");
-                while (query.next())
-                {
-                    dictionary.insert_bulk(query.value(0).toString(), PHRASE, query.value(1).toString());
-                }
+                    // The trie branches on UTF-16 units, so a key outside the BMP is sharded by
+                    // its high surrogate, the edge it hangs from, not by its whole code point.
+                    const auto select = [&](const QString& columns, const QString& table, const QString& key)
+                    {
+                        const QString unit = "CASE WHEN unicode(" + key + ") >= 65536"
+                            " THEN 55296 + ((unicode(" + key + ") - 65536) >> 10)"
+                            " ELSE coalesce(unicode(" + key + "), 0) END";
+                        query.prepare("SELECT " + columns + " FROM " + table
+                            + " WHERE (" + unit + ") % :shards = :shard");
+                        query.bindValue(":shards", shard_count);
+                        query.bindValue(":shard", shard);
+                        query.exec();
+                    };
 
-                query.exec("SELECT original_start, original_end, translated_start, translated_end FROM grammar_rules");
-                while (query.next())
-                {
-                    dictionary.insert_rule(query.value(0).toString(), query.value(1).toString(),
-                                           query.value(2).toString(), query.value(3).toString());
+                    select("original, translated", "names", "original");
+                    while (query.next())
+                    {
+                        rows.push_back({query.value(0).toString(), NAME, query.value(1).toString(), {}});
+                    }
+
+                    select("original, translated", "phrases", "original");
+                    while (query.next())
+                    {
+                        rows.push_back({query.value(0).toString(), PHRASE, query.value(1).toString(), {}});
+                    }
+
+                    select("original_start, original_end, translated_start, translated_end", "grammar_rules",
+                           "original_start");
+                    while (query.next())
+                    {
+                        Rule rule{query.value(0).toString(), query.value(1).toString(),
+                                  query.value(2).toString(), query.value(3).toString()};
+                        rows.push_back({rule.original_start, NONE, {}, std::move(rule)});
+                    }
+                    db.close();
+
+                    // Stable, so a key's rules keep the order the table had them in.
+                    std::ranges::stable_sort(rows, {}, &LoadedRow::key);
+
+                    SortedBuilder builder((*parts)[shard]);
+                    for (const auto& [key, priority, value, rule] : rows)
+                    {
+                        if (priority == NONE) builder.add_rule(rule);
+                        else builder.add(key, priority, value);
+                    }
                 }
-                db.close();
             }
-        }
-        QSqlDatabase::removeDatabase("NP_thread");
-    });
+            QSqlDatabase::removeDatabase(connection);
+        }));
+    }
 
-    const QFuture<void> master_future = QtConcurrent::run([future_sv, future_punc, future_trie]() mutable
+    const QFuture<void> master_future = QtConcurrent::run([future_sv, future_punc, future_shards, parts, source]() mutable
     {
         future_sv.waitForFinished();
         future_punc.waitForFinished();
-        future_trie.waitForFinished();
+        for (auto& future : future_shards)
+        {
+            future.waitForFinished();
+        }
+
+        for (Dictionary& part : *parts)
+        {
+            dictionary.graft(std::move(part));
+        }
+        parts->clear();
+
+        // Freezing stores each key's reading, so it waits for the character table.
+        auto chars = std::make_shared<CharTable>();
+        chars->build(sv_readings, punctuations);
+        char_table.store(chars);
+
+        const LayoutProfile profile = LayoutProfile::load(LAYOUT_PROFILE);
+        dictionary.freeze(*chars, &profile);
+        write_snapshot("dict.db", source, dictionary.image(),
+                       {sv_readings, punctuations, name_sets, read_name_set_entries()});
+        if (compact_dictionary) dictionary.compact();
     });
 
     auto* watcher = new QFutureWatcher<void>();
@@ -131,19 +298,70 @@ void load_name_sets_data()
     }
 }
 
+// Keeps the callback asynchronous, exactly as when the data comes from the database.
+static void finish_later(const std::function<void()>& on_finished)
+{
+    QMetaObject::invokeMethod(QCoreApplication::instance(), [on_finished]
+    {
+        if (on_finished) on_finished();
+    }, Qt::QueuedConnection);
+}
+
+// Rebuilds the trie behind the dictionary served from the snapshot on a worker, so the
+// first edit takes it from there instead of rebuilding it on this thread.
+static void thaw_later()
+{
+    const auto base = dictionary.pin();
+    const QFuture<std::shared_ptr<Dictionary>> thawing = QtConcurrent::run([base]
+    {
+        return std::make_shared<Dictionary>(Dictionary::pruned(*base));
+    });
+    dictionary.thaw_with([thawing] { return std::move(*thawing.result()); });
+}
+
+bool load_from_snapshot(const std::function<void()>& on_finished)
+{
+    snapshot = open_snapshot("dict.db");
+    if (!snapshot) return false;
+
+    // The database has not changed since the snapshot was written from it.
+    loaded_version = journal_head();
+    apply_snapshot(snapshot);
+    if (compact_dictionary) dictionary.compact();
+    else thaw_later();
+
+    finish_later(on_finished);
+    return true;
+}
+
 void load_dict(const std::function<void()>& on_finished)
 {
     init_db();
+    if (load_from_snapshot(on_finished)) return;
+
+    // The snapshot is rebuilt from scratch now, so this is the one start that can
+    // afford to compact the database. Everything journaled so far is about to be read
+    // in full; a reload in another instance that still needs it falls back to that too.
+    QSqlQuery query;
+    query.exec("DELETE FROM change_log;");
+    query.exec("VACUUM;");
+
     load_name_sets_data();
     load_global_data(on_finished);
 }
 
-void load_name_set(const int id)
+static QHash<QString, QString>& cached_name_set(const int id)
 {
-    current_name_set_id = id;
-    name_set_dictionary = Dictionary();
+    if (const auto it = name_set_cache.find(id); it != name_set_cache.end())
+    {
+        return it->second;
+    }
 
-    if (id == -1) return;
+    QHash<QString, QString>& entries = name_set_cache[id];
+    if (snapshot && snapshot_is_current(*snapshot, "dict.db") && load_snapshot_name_set(*snapshot, id, entries))
+    {
+        return entries;
+    }
 
     QSqlQuery query;
     query.prepare("SELECT original, translated FROM name_set_entries WHERE set_id = :id");
@@ -153,21 +371,416 @@ void load_name_set(const int id)
     {
         while (query.next())
         {
-            QString key = query.value(0).toString();
-            QString val = query.value(1).toString();
-            name_set_dictionary.insert_bulk(key, NAME, val);
+            entries.insert(query.value(0).toString(), query.value(1).toString());
+        }
+    }
+    return entries;
+}
+
+// What the active stack translates key to: the entry of the first set that has one.
+static const QString* resolve_name(const QString& key)
+{
+    for (const int id : active_name_sets)
+    {
+        const QHash<QString, QString>& entries = name_set_cache.at(id);
+        if (const auto it = entries.constFind(key); it != entries.cend())
+        {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+// Points the overlay's entry for key at whatever the active stack now gives it. Publishing
+// is left to the caller, so a batch of keys goes out as one version.
+static void resolve_overlay(const QString& key)
+{
+    if (const QString* translation = resolve_name(key))
+    {
+        name_set_dictionary.insert_bulk(key, NAME, *translation);
+    }
+    else
+    {
+        name_set_dictionary.remove_bulk(key, NAME);
+    }
+}
+
+void set_active_name_sets(std::vector<int> ids)
+{
+    std::vector<int> unique;
+    for (const int id : ids)
+    {
+        if (id != -1 && std::ranges::find(unique, id) == unique.end())
+        {
+            unique.push_back(id);
+            cached_name_set(id);
+        }
+    }
+
+    // A key only changes hands when a set holding it is added, dropped, or moved past
+    // another one, so those sets' keys are the only ones to resolve again.
+    std::vector<int> changed;
+    std::vector<int> kept_before;
+    std::vector<int> kept_after;
+    for (const int id : active_name_sets)
+    {
+        if (std::ranges::find(unique, id) == unique.end()) changed.push_back(id);
+        else kept_before.push_back(id);
+    }
+    for (const int id : unique)
+    {
+        if (std::ranges::find(active_name_sets, id) == active_name_sets.end()) changed.push_back(id);
+        else kept_after.push_back(id);
+    }
+    if (kept_before != kept_after)
+    {
+        changed.insert(changed.end(), kept_after.begin(), kept_after.end());
+    }
+
+    active_name_sets = std::move(unique);
+    current_name_set_id = active_name_sets.empty() ? -1 : active_name_sets.front();
+
+    if (changed.empty()) return;
+
+    for (const int id : changed)
+    {
+        const QHash<QString, QString>& entries = name_set_cache.at(id);
+        for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+        {
+            resolve_overlay(it.key());
+        }
+    }
+    // Left as a trie, read through its root table: freezing would rebuild the whole overlay
+    // and undo what resolving only the changed keys saved.
+    name_set_dictionary.publish();
+}
+
+void forget_name_set(const int id)
+{
+    std::vector<int> remaining = active_name_sets;
+    std::erase(remaining, id);
+    set_active_name_sets(std::move(remaining));
+    name_set_cache.erase(id);
+}
+
+void name_set_insert(const int id, const QString& key, const QString& value)
+{
+    cached_name_set(id).insert(key, value);
+    resolve_overlay(key);
+    name_set_dictionary.publish();
+}
+
+void name_set_remove(const int id, const QString& key)
+{
+    cached_name_set(id).remove(key);
+    resolve_overlay(key);
+    name_set_dictionary.publish();
+}
+
+// Rewrites the snapshot from the global dictionary as it is now, on a worker. One left on
+// its trie by edits is frozen there first, as a full load would leave it, and the frozen
+// copy is swapped in on this thread unless an edit got there first. source must have been
+// taken before anything the dictionary now holds was read from the database.
+static void write_snapshot_later(const DbFingerprint& source)
+{
+    const auto base = dictionary.pin();
+    const auto chars = char_table.load();
+    const int reload = reload_count;
+    SnapshotTables tables{sv_readings, punctuations, name_sets, {}};
+    auto* watcher = new QFutureWatcher<std::shared_ptr<Dictionary>>();
+
+    QObject::connect(watcher, &QFutureWatcher<std::shared_ptr<Dictionary>>::finished, [watcher, base, reload]()
+    {
+        // After a reload the dictionary may be filling up on another thread; the copy is stale anyway.
+        if (reload == reload_count)
+        {
+            if (const auto copy = watcher->result()) dictionary.adopt_pruned(std::move(*copy), base);
+            snapshot = open_snapshot("dict.db");
         }
+
+        watcher->deleteLater();
+    });
+
+    watcher->setFuture(QtConcurrent::run([base, chars, source, tables = std::move(tables)]() mutable
+    {
+        std::shared_ptr<Dictionary> copy;
+        const DoubleArrayTrie* image = base->image();
+        if (!image)
+        {
+            copy = std::make_shared<Dictionary>(Dictionary::pruned(*base));
+            const LayoutProfile profile = LayoutProfile::load(LAYOUT_PROFILE);
+            copy->freeze(*chars, &profile);
+            image = copy->image();
+        }
+
+        tables.name_set_entries = read_name_set_entries();
+        write_snapshot("dict.db", source, image, tables);
+        if (copy && compact_dictionary) copy->compact();
+        return copy;
+    }));
+}
+
+// Reads again every row the journal recorded since the data in memory was loaded, and
+// applies it. Fails without touching anything when that cannot be done: the journal was
+// pruned past the loaded version, or the readings or punctuation changed, which the
+// character table and every stored reading depend on.
+static bool apply_journal()
+{
+    if (loaded_version < 0) return false;
+
+    // Taken first, so a write landing while the journal is read leaves the snapshot stale.
+    const DbFingerprint fingerprint = db_fingerprint("dict.db");
+    const qint64 head = journal_head();
+    if (head == loaded_version) return true;
+
+    QSqlQuery query;
+    query.prepare("SELECT source, original, scope FROM change_log WHERE version > :version");
+    query.bindValue(":version", loaded_version);
+    if (!query.exec()) return false;
+
+    qint64 count = 0;
+    std::set<std::tuple<QString, QString, QString>> changes;
+    while (query.next())
+    {
+        ++count;
+        changes.emplace(query.value(0).toString(), query.value(1).toString(), query.value(2).toString());
+    }
+    if (count != head - loaded_version) return false;
+
+    for (const auto& [source, original, scope] : changes)
+    {
+        if (source == "sv_readings" || source == "punctuations" || source == "name_sets") return false;
     }
+
+    bool dictionary_changed = false;
+    bool overlay_changed = false;
+    for (const auto& [source, original, scope] : changes)
+    {
+        QSqlQuery row;
+        if (source == "names" || source == "phrases")
+        {
+            row.prepare("SELECT translated FROM " + source + " WHERE original = :original");
+            row.bindValue(":original", original);
+
+            const Priority priority = source == "names" ? NAME : PHRASE;
+            dictionary_changed = true;
+            if (row.exec() && row.next())
+            {
+                dictionary.insert_bulk(original, priority, row.value(0).toString());
+            }
+            else
+            {
+                dictionary.remove_bulk(original, priority);
+            }
+        }
+        else if (source == "grammar_rules")
+        {
+            row.prepare("SELECT translated_start, translated_end FROM grammar_rules "
+                        "WHERE original_start = :start AND original_end = :end");
+            row.bindValue(":start", original);
+            row.bindValue(":end", scope);
+            dictionary_changed = true;
+
+            if (!row.exec() || !row.next())
+            {
+                dictionary.remove_rule(original, scope);
+            }
+            else if (dictionary.find_exact_rule(original, scope))
+            {
+                dictionary.edit_rule(original, scope, row.value(0).toString(), row.value(1).toString());
+            }
+            else
+            {
+                dictionary.insert_rule(original, scope, row.value(0).toString(), row.value(1).toString());
+            }
+        }
+        else if (source == "name_set_entries")
+        {
+            // Sets not read yet pick the change up whenever they are.
+            const auto set = name_set_cache.find(scope.toInt());
+            if (set == name_set_cache.end()) continue;
+
+            row.prepare("SELECT translated FROM name_set_entries WHERE set_id = :id AND original = :original");
+            row.bindValue(":id", set->first);
+            row.bindValue(":original", original);
+
+            if (row.exec() && row.next())
+            {
+                set->second.insert(original, row.value(0).toString());
+            }
+            else
+            {
+                set->second.remove(original);
+            }
+            resolve_overlay(original);
+            overlay_changed = true;
+        }
+    }
+
+    // Only the rows go in here. Freezing again and rewriting the snapshot cost the whole
+    // dictionary, so they are left to a worker.
+    if (dictionary_changed) dictionary.publish();
+    if (overlay_changed) name_set_dictionary.publish();
+    write_snapshot_later(fingerprint);
+
+    loaded_version = head;
+    return true;
 }
 
 void reload_dict(const std::function<void()>& on_finished)
 {
+    ++reload_count;
+    if (apply_journal())
+    {
+        finish_later(on_finished);
+        return;
+    }
+
     sv_readings.clear();
     punctuations.clear();
     dictionary = Dictionary();
     name_sets.clear();
 
+    // Every active set is read again and merged from scratch.
+    std::vector<int> stack = std::exchange(active_name_sets, {});
+    name_set_cache.clear();
+    name_set_dictionary = Dictionary();
+
+    if (load_from_snapshot(on_finished))
+    {
+        set_active_name_sets(std::move(stack));
+        return;
+    }
+
+    // Name sets are stacked again once the global data is in, as on a first start.
     load_name_sets_data();
-    load_name_set(current_name_set_id);
-    load_global_data(on_finished);
+    load_global_data([on_finished, stack = std::move(stack)]() mutable
+    {
+        set_active_name_sets(std::move(stack));
+        if (on_finished) on_finished();
+    });
+}
+
+// A target never has more than one copy in the works; a later call while one is running
+// just waits for the next round. With refreeze, the copy is also frozen as a full load
+// would leave it, whenever edits have left the target on its trie.
+static void prune_later(Dictionary& target, bool& running, const bool refreeze)
+{
+    if (running || target.is_frozen() || (!refreeze && !target.removals())) return;
+    running = true;
+
+    const auto base = target.pin();
+    const auto chars = char_table.load();
+    const int reload = reload_count;
+    auto* watcher = new QFutureWatcher<std::shared_ptr<Dictionary>>();
+
+    QObject::connect(watcher, &QFutureWatcher<std::shared_ptr<Dictionary>>::finished,
+                     [watcher, base, reload, &target, &running]()
+    {
+        // After a reload the target may be filling up on another thread; the copy is stale anyway.
+        if (reload == reload_count) target.adopt_pruned(std::move(*watcher->result()), base);
+        running = false;
+
+        watcher->deleteLater();
+    });
+
+    watcher->setFuture(QtConcurrent::run([base, chars, refreeze]
+    {
+        auto copy = std::make_shared<Dictionary>(Dictionary::pruned(*base));
+        if (refreeze)
+        {
+            const LayoutProfile profile = LayoutProfile::load(LAYOUT_PROFILE);
+            copy->freeze(*chars, &profile);
+            if (compact_dictionary) copy->compact();
+        }
+        return copy;
+    }));
+}
+
+void prune_dictionaries_later()
+{
+    static bool pruning_dictionary = false;
+    static bool pruning_name_sets = false;
+
+    prune_later(dictionary, pruning_dictionary, true);
+    prune_later(name_set_dictionary, pruning_name_sets, false);
+}
+
+bool train_layout(const QStringList& texts)
+{
+    const DoubleArrayTrie* image = dictionary.image();
+    if (!image) return false;
+
+    LayoutProfile profile;
+    for (const QString& text : texts)
+    {
+        profile.record(*image, text);
+    }
+    if (!profile.save(LAYOUT_PROFILE)) return false;
+
+    dictionary.relayout(*char_table.load(), profile);
+    if (!write_snapshot("dict.db", db_fingerprint("dict.db"), dictionary.image(),
+                        {sv_readings, punctuations, name_sets, read_name_set_entries()}))
+    {
+        return false;
+    }
+    if (compact_dictionary) dictionary.compact();
+    return true;
+}
+
+static QString format_bytes(const size_t bytes)
+{
+    if (bytes < 1024) return QString::number(bytes) + " B";
+    if (bytes < 1024 * 1024) return QString::number(static_cast<double>(bytes) / 1024, 'f', 1) + " KB";
+    return QString::number(static_cast<double>(bytes) / (1024 * 1024), 'f', 1) + " MB";
+}
+
+static QString format_stats(const QString& title, const DictionaryStats& stats)
+{
+    auto payloads = [](const DictionaryStats::Payloads& payload)
+    {
+        return QString::number(payload.nodes) + " nodes, " + format_bytes(payload.bytes);
+    };
+
+    QString depths;
+    for (size_t depth = 0; depth < stats.depths.size(); ++depth)
+    {
+        depths += " " + QString::number(depth) + ":" + QString::number(stats.depths[depth]);
+    }
+
+    QString fanouts;
+    for (size_t bucket = 0; bucket < stats.fanouts.size(); ++bucket)
+    {
+        const size_t low = bucket ? size_t{1} << (bucket - 1) : 0;
+        const size_t high = bucket ? (size_t{1} << bucket) - 1 : 0;
+        fanouts += " " + QString::number(low) + (high > low ? "-" + QString::number(high) : QString())
+            + ":" + QString::number(stats.fanouts[bucket]);
+    }
+
+    const PoolUsage& pool = stats.pool;
+    QString text;
+    text += title + (stats.from_image ? " (shape rebuilt from its image)" : QString()) + "\n";
+    text += "  Nodes: " + QString::number(stats.nodes) + "\n";
+    text += "  Child blocks: " + QString::number(stats.child_blocks) + ", " + format_bytes(stats.child_block_bytes)
+        + " (" + format_bytes(stats.child_block_slack) + " unused)\n";
+    text += "  Names (TAG_NAME): " + payloads(stats.names) + "\n";
+    text += "  Phrases (TAG_PHRASE): " + payloads(stats.phrases) + "\n";
+    text += "  Rules or mixed (TAG_COMPLEX): " + payloads(stats.complex) + "\n";
+    text += "  Rules: " + QString::number(stats.rules) + "\n";
+    text += "  Depths:" + depths + "\n";
+    text += "  Fanouts:" + fanouts + "\n";
+    text += "  Node pool: " + QString::number(pool.blocks) + " blocks, " + format_bytes(pool.block_bytes) + "; "
+        + QString::number(pool.node_data) + " node data\n";
+    text += "  Free for reuse: " + QString::number(pool.free_nodes) + " nodes, "
+        + QString::number(pool.free_child_blocks) + " child blocks (" + format_bytes(pool.free_child_bytes) + "), "
+        + QString::number(pool.free_node_data) + " node data\n";
+    text += "  Strings: " + format_bytes(stats.string_bytes) + "\n";
+    text += "  Image: " + format_bytes(stats.image_bytes) + "\n";
+    return text;
+}
+
+QString dictionary_report()
+{
+    return format_stats("Global dictionary", dictionary.stats()) + "\n"
+        + format_stats("Name sets", name_set_dictionary.stats());
 }
@@ -2,16 +2,47 @@
 
 #include <QHash>
 #include <QString>
+#include <atomic>
+#include <memory>
 
+#include "chartable.h"
 #include "structures.h"
 
 inline QHash<QChar, QString> sv_readings;
 inline QHash<QChar, QChar> punctuations;
+// Replaced as a whole when the readings or punctuation change, never edited in place: a
+// conversion pins the table it started with (see LatticeSource) and reads it to the end.
+inline std::atomic<std::shared_ptr<const CharTable>> char_table{std::make_shared<const CharTable>()};
 inline Dictionary dictionary;
+// Every active name set merged into one overlay, so lookups walk it once however many
+// sets are stacked. Where sets disagree, the one listed first in active_name_sets wins.
 inline Dictionary name_set_dictionary;
+inline std::vector<int> active_name_sets;
+// The set edits go to: the first active one, or -1 when none is.
 inline int current_name_set_id = -1;
 inline std::vector<NameSet> name_sets;
+// Set before loading to serve the global dictionary from a compacted image (see
+// Dictionary::compact()), for processes that care more about memory than lookup speed.
+inline bool compact_dictionary = false;
 
 void load_dict(const std::function<void()>& on_finished);
-void load_name_set(int id);
+// Stacks the given sets, highest priority first. Each set is read from storage only the
+// first time it is used; after that only the keys whose winner changed are touched.
+void set_active_name_sets(std::vector<int> ids);
+// Drops a deleted set from the stack and from memory.
+void forget_name_set(int id);
+void name_set_insert(int id, const QString& key, const QString& value);
+void name_set_remove(int id, const QString& key);
 void reload_dict(const std::function<void()>& on_finished);
+// Copies the global dictionary and the overlay without what removals left behind, on
+// worker threads, and swaps each copy in on this thread unless an edit got there first.
+// The global dictionary's copy is frozen there too, so after edits its lookups go back to
+// a double array. Does nothing for one that has not changed since.
+void prune_dictionaries_later();
+// Records which dictionary states converting texts steps on, saves that as the layout
+// profile and rebuilds the global dictionary and its snapshot hottest-first (see
+// LayoutProfile). Loads that rebuild the snapshot later keep using the saved profile.
+// Fails if the dictionary is not serving from a double array, e.g. when compacted.
+bool train_layout(const QStringList& texts);
+// Memory and shape statistics of the global dictionary and the name-set overlay, as text.
+QString dictionary_report();
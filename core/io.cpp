@@ -97,7 +97,7 @@ void io_insert(const int id, const QString& key, const QString& value, const Pri
     }
     else
     {
-        name_set_dictionary.insert(key, value, priority);
+        name_set_insert(id, key, value);
         nameset_db_insert(key, value);
     }
 }
@@ -117,7 +117,7 @@ void io_remove(const int id, const QString& key, const Priority priority)
     }
     else
     {
-        name_set_dictionary.remove(key, priority);
+        name_set_remove(id, key);
         nameset_db_remove(key);
     }
 }
@@ -0,0 +1,144 @@
+#include <QtConcurrent>
+
+#include "lattice.h"
+#include "dict.h"
+
+// Below this, handing chunks to the thread pool costs more than the walks themselves.
+static constexpr int PARALLEL_THRESHOLD = 32768;
+static constexpr int CHUNK_SIZE = 8192;
+
+LatticeSource LatticeSource::pin()
+{
+    return {dictionary.pin(), active_name_sets.empty() ? nullptr : name_set_dictionary.pin(), char_table.load()};
+}
+
+// A conversion's pin can outlast many lattices, as can a worker converting file after file, so
+// text decoded from a LOUDS image goes into a cache each lattice owns instead: it holds the
+// blocks its hits point into for as long as they are read, and nothing after.
+static LatticeSource own_texts(LatticeSource source)
+{
+    source.global = DictionaryVersion::reader(std::move(source.global));
+    if (source.name_set) source.name_set = DictionaryVersion::reader(std::move(source.name_set));
+    return source;
+}
+
+MatchLattice::MatchLattice(LatticeSource source, const QStringView& text, const int begin, const int end)
+    : source(own_texts(std::move(source))), first(begin), table(build(text, begin, end))
+{
+}
+
+MatchLattice::Column MatchLattice::build(const QStringView& text, const int begin, const int end) const
+{
+    const DictionaryVersion* global_version = source.global.get();
+    const DictionaryVersion* name_set_version = source.name_set.get();
+
+    auto fill = [&](Column& column, const int from, const int to)
+    {
+        column.offsets.reserve(to - from);
+        for (int pos = from; pos < to; ++pos)
+        {
+            column.offsets.push_back(static_cast<uint32_t>(column.hits.size()));
+
+            // Most characters of a text start nothing at all, and cost no walk.
+            const QChar ch = text[pos];
+            if (!global_version->may_start(ch) && !(name_set_version && name_set_version->may_start(ch)))
+            {
+                continue;
+            }
+
+            if (name_set_version)
+            {
+                global_version->find_layered_prefixes(*name_set_version, text, pos, column.hits);
+            }
+            else
+            {
+                global_version->find_prefixes(text, pos, column.hits);
+            }
+        }
+    };
+
+    Column column;
+
+    if (end - begin < PARALLEL_THRESHOLD)
+    {
+        fill(column, begin, end);
+    }
+    else
+    {
+        struct Chunk
+        {
+            int begin;
+            int end;
+            Column column;
+        };
+
+        std::vector<Chunk> chunks;
+        for (int from = begin; from < end; from += CHUNK_SIZE)
+        {
+            chunks.push_back({from, std::min(from + CHUNK_SIZE, end), {}});
+        }
+
+        QtConcurrent::blockingMap(chunks, [&](Chunk& chunk)
+        {
+            fill(chunk.column, chunk.begin, chunk.end);
+        });
+
+        size_t total = 0;
+        for (const auto& chunk : chunks) total += chunk.column.hits.size();
+
+        column.hits.reserve(total);
+        column.offsets.reserve(end - begin + 1);
+        for (const auto& chunk : chunks)
+        {
+            const auto base = static_cast<uint32_t>(column.hits.size());
+            for (const uint32_t offset : chunk.column.offsets)
+            {
+                column.offsets.push_back(base + offset);
+            }
+            column.hits.insert(column.hits.end(), chunk.column.hits.begin(), chunk.column.hits.end());
+        }
+    }
+
+    column.offsets.push_back(static_cast<uint32_t>(column.hits.size()));
+    return column;
+}
+
+LayeredMatch MatchLattice::at(const int pos, const int end) const
+{
+    LayeredMatch match{{0, NONE, nullptr, {}, {}}, {0, NONE, nullptr, {}, {}}};
+    if (!covers(pos)) return match;
+
+    const int limit = end - pos;
+    for (uint32_t h = table.offsets[pos - first]; h < table.offsets[pos - first + 1]; ++h)
+    {
+        const PrefixHit& hit = table.hits[h];
+        if (hit.length > limit) break;
+
+        Match& layer = hit.overlay ? match.name_set : match.global;
+        if (hit.rules)
+        {
+            layer.rules = hit.rules;
+        }
+        if (hit.priority != NONE)
+        {
+            layer.length = hit.length;
+            layer.priority = hit.priority;
+            layer.translation = hit.translation;
+            layer.reading = hit.reading;
+        }
+    }
+    return match;
+}
+
+std::span<const PrefixHit> MatchLattice::hits(const int pos, const int end) const
+{
+    if (!covers(pos)) return {};
+
+    const PrefixHit* from = table.hits.data() + table.offsets[pos - first];
+    const PrefixHit* to = table.hits.data() + table.offsets[pos - first + 1];
+    const PrefixHit* fitting = std::partition_point(from, to, [limit = end - pos](const PrefixHit& hit)
+    {
+        return hit.length <= limit;
+    });
+    return {from, fitting};
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <span>
+#include <vector>
+
+#include "chartable.h"
+#include "structures.h"
+
+// Both layers' matches at one position.
+struct LayeredMatch
+{
+    Match name_set;
+    Match global;
+};
+
+// The dictionary versions and character table one conversion reads, pinned once so that
+// every lattice built for it sees the same state, whatever is edited or reloaded meanwhile.
+struct LatticeSource
+{
+    std::shared_ptr<const DictionaryVersion> global;
+    std::shared_ptr<const DictionaryVersion> name_set; // Null when no name set is active.
+    std::shared_ptr<const CharTable> chars;
+
+    // Also reads which name sets are active, so it belongs on the thread that edits them.
+    static LatticeSource pin();
+};
+
+// Every dictionary hit for every start position of one input, looked up once up front.
+// With a name set, each position's hits come from one walk over both dictionaries.
+// Queries take the end of the span being converted, so a rule's inner text sees exactly
+// the matches a lookup on that span alone would have produced. The lattice holds on to its
+// source, so edits made meanwhile never reach its hits, nor reloads the table in chars().
+class MatchLattice
+{
+public:
+    // Only looks up the positions in [begin, end); any other has no hits. The walks from them
+    // still read on past end.
+    MatchLattice(LatticeSource source, const QStringView& text, int begin, int end);
+
+    // Same results as name_set_dictionary.find(text.first(end), pos) and
+    // dictionary.find(text.first(end), pos), from a single scan of the position's hits.
+    [[nodiscard]] LayeredMatch at(int pos, int end) const;
+    // Every hit from pos that ends by end, shortest first; at equal length the name set's
+    // comes first.
+    [[nodiscard]] std::span<const PrefixHit> hits(int pos, int end) const;
+    [[nodiscard]] const CharTable& chars() const { return *source.chars; }
+
+private:
+    struct Column
+    {
+        std::vector<PrefixHit> hits;
+        std::vector<uint32_t> offsets;
+    };
+
+    LatticeSource source;
+    int first; // Position of the first column
+    Column table;
+
+    [[nodiscard]] Column build(const QStringView& text, int begin, int end) const;
+    [[nodiscard]] bool covers(const int pos) const
+    {
+        return pos >= first && pos - first < static_cast<int>(table.offsets.size()) - 1;
+    }
+};
@@ -0,0 +1,393 @@
+#include "louds.h"
+#include "datrie.h"
+
+#include <QHash>
+#include <algorithm>
+#include <bit>
+#include <mutex>
+
+// Raw UTF-8 per block before compression: big enough for zlib to find repeats, small
+// enough that a lookup never decodes much it does not need.
+static constexpr qsizetype BLOCK_BYTES = 4096;
+// A text ref is a block index above the text's index within that block. Every text takes
+// at least its terminator, so a block never holds BLOCK_BYTES of them.
+static constexpr uint32_t INDEX_BITS = 12;
+static_assert(BLOCK_BYTES <= qsizetype{1} << INDEX_BITS);
+// The last index is left out, so no ref can be NO_TEXT.
+static constexpr size_t MAX_BLOCKS = (size_t{1} << (32 - INDEX_BITS)) - 1;
+
+// What build_from() reads: a node's children in character order, and what its key holds.
+struct NodeSource {
+    using Node = const TrieNode*;
+    Node root;
+
+    template <typename Visit>
+    void children(const Node node, Visit&& visit) const {
+        for (const auto& [ch, child] : node->children()) {
+            visit(ch.unicode(), child);
+        }
+    }
+    [[nodiscard]] Entry entry(const Node node) const {
+        Entry result;
+        if (const StringArena::Handle name = node->get_name()) result.name = StringArena::view(name);
+        if (const StringArena::Handle phrases = node->get_phrases()) result.phrases = StringArena::view(phrases);
+        result.rules = node->get_rules();
+        return result;
+    }
+};
+
+struct ArraySource {
+    using Node = int32_t;
+    const DoubleArrayTrie& image;
+    DoubleArrayTrie::Edges edges = image.edges();
+    Node root = 0;
+
+    template <typename Visit>
+    void children(const Node node, Visit&& visit) const {
+        for (uint32_t i = edges.first[node]; i < edges.first[node + 1]; ++i) {
+            visit(edges.children[i].first, edges.children[i].second);
+        }
+    }
+    [[nodiscard]] Entry entry(const Node node) const { return image.entry_at(node); }
+};
+
+std::optional<LoudsTrie> LoudsTrie::build(const TrieNode* root)
+{
+    return build_from(NodeSource{root});
+}
+
+std::optional<LoudsTrie> LoudsTrie::build(const DoubleArrayTrie& image)
+{
+    if (image.image().units.empty()) {
+        const TrieNode empty;
+        return build_from(NodeSource{&empty});
+    }
+    return build_from(ArraySource{image});
+}
+
+template <typename Source>
+std::optional<LoudsTrie> LoudsTrie::build_from(const Source& source)
+{
+    using Node = typename Source::Node;
+    LoudsTrie trie;
+
+    // Texts go out in depth-first order, so the keys along one walk mostly share a block.
+    // Equal texts are stored once, whichever keys they belong to.
+    QHash<QStringView, uint32_t> refs;
+    QByteArray raw;
+    uint32_t count = 0;
+
+    auto flush = [&] {
+        if (!count) return;
+        trie.blocks.push_back(qCompress(raw));
+        raw.clear();
+        count = 0;
+    };
+    auto add_text = [&](const std::optional<QStringView> text) {
+        if (!text || refs.contains(*text)) return;
+        if (raw.size() >= BLOCK_BYTES) flush();
+
+        refs.insert(*text, static_cast<uint32_t>(trie.blocks.size()) << INDEX_BITS | count);
+        raw += text->toUtf8();
+        raw += '\0';
+        ++count;
+    };
+
+    std::vector<Node> stack{source.root};
+    while (!stack.empty()) {
+        const Node node = stack.back();
+        stack.pop_back();
+
+        const Entry entry = source.entry(node);
+        add_text(entry.name);
+        add_text(entry.phrases);
+
+        const size_t first = stack.size();
+        source.children(node, [&](char16_t, const Node child) { stack.push_back(child); });
+        std::reverse(stack.begin() + static_cast<std::ptrdiff_t>(first), stack.end());
+    }
+    flush();
+    if (trie.blocks.size() > MAX_BLOCKS) return std::nullopt;
+    trie.blocks.shrink_to_fit();
+
+    // Group 0 stands for an empty rule list, which still shadows shorter rule starts.
+    trie.rule_groups.emplace_back();
+
+    std::vector<Node> queue{source.root};
+    trie.labels.push_back(0);
+
+    size_t bits = 0;
+    auto push_bit = [&](const bool one) {
+        if (bits % 64 == 0) trie.louds.push_back(0);
+        if (one) trie.louds.back() |= uint64_t{1} << (bits % 64);
+        ++bits;
+    };
+
+    size_t zeros = 0;
+    for (size_t id = 0; id < queue.size(); ++id) {
+        const Node node = queue[id];
+
+        source.children(node, [&](const char16_t label, const Node child) {
+            push_bit(true);
+            queue.push_back(child);
+            trie.labels.push_back(label);
+        });
+
+        if (zeros % ZERO_SAMPLE == 0) trie.zero_samples.push_back(static_cast<uint32_t>(bits));
+        push_bit(false);
+        ++zeros;
+
+        if (id % 64 == 0) {
+            trie.has_payload.push_back(0);
+            trie.payload_ranks.push_back(static_cast<uint32_t>(trie.payloads.size()));
+        }
+
+        const auto [name, phrases, rules] = source.entry(node);
+        if (!name && !phrases && !rules) continue;
+
+        Payload payload;
+        if (name) payload.name = refs.value(*name);
+        if (phrases) payload.phrases = refs.value(*phrases);
+        if (rules) {
+            if (rules->empty()) {
+                payload.rules = 0;
+            } else {
+                payload.rules = static_cast<int32_t>(trie.rule_groups.size());
+                trie.rule_groups.push_back(*rules);
+            }
+        }
+
+        trie.has_payload.back() |= uint64_t{1} << (id % 64);
+        trie.payloads.push_back(payload);
+    }
+
+    if (bits % 64) trie.louds.back() |= ~uint64_t{0} << (bits % 64);
+
+    trie.louds.shrink_to_fit();
+    trie.zero_samples.shrink_to_fit();
+    trie.labels.shrink_to_fit();
+    trie.has_payload.shrink_to_fit();
+    trie.payload_ranks.shrink_to_fit();
+    trie.payloads.shrink_to_fit();
+    return trie;
+}
+
+// Position of the zero with the given rank (counting from 0).
+size_t LoudsTrie::select_zero(const size_t rank) const
+{
+    size_t position = zero_samples[rank / ZERO_SAMPLE];
+    size_t remaining = rank % ZERO_SAMPLE;
+
+    size_t word = position / 64;
+    uint64_t zeros = ~louds[word] & (~uint64_t{0} << (position % 64));
+    while (true) {
+        if (const auto here = static_cast<size_t>(std::popcount(zeros)); remaining < here) {
+            for (; remaining; --remaining) {
+                zeros &= zeros - 1;
+            }
+            return word * 64 + std::countr_zero(zeros);
+        } else {
+            remaining -= here;
+        }
+        zeros = ~louds[++word];
+    }
+}
+
+size_t LoudsTrie::next_zero(const size_t position) const
+{
+    size_t word = position / 64;
+    uint64_t zeros = ~louds[word] & (~uint64_t{0} << (position % 64));
+    while (!zeros) {
+        zeros = ~louds[++word];
+    }
+    return word * 64 + std::countr_zero(zeros);
+}
+
+int32_t LoudsTrie::step(const int32_t state, const QChar ch) const
+{
+    // Node v's children are the ones between its parent-order zeros v - 1 and v; the ones
+    // before them each stand for one node, numbered from 1 in the same order.
+    const auto node = static_cast<size_t>(state);
+    const size_t begin = node ? select_zero(node - 1) + 1 : 0;
+    const size_t end = next_zero(begin);
+
+    const char16_t* first = labels.data() + (begin - node + 1);
+    const char16_t* last = first + (end - begin);
+    const char16_t* found = std::lower_bound(first, last, ch.unicode());
+    return found != last && *found == ch.unicode() ? static_cast<int32_t>(found - labels.data()) : -1;
+}
+
+const LoudsTrie::Payload* LoudsTrie::payload(const int32_t node) const
+{
+    const uint64_t word = has_payload[node / 64];
+    const uint64_t bit = uint64_t{1} << (node % 64);
+    if (!(word & bit)) return nullptr;
+
+    return &payloads[payload_ranks[node / 64] + std::popcount(word & (bit - 1))];
+}
+
+QStringView LoudsTrie::text(const uint32_t ref, DecodedTexts& texts) const
+{
+    const uint32_t index = ref >> INDEX_BITS;
+    const DecodedTexts::Block* block = nullptr;
+    {
+        std::shared_lock lock(texts.mutex);
+        if (const auto it = texts.blocks.find(index); it != texts.blocks.end()) {
+            block = &it->second;
+        }
+    }
+
+    if (!block) {
+        // Decoded outside the lock; if another thread got there first, its copy is kept.
+        DecodedTexts::Block decoded;
+        decoded.text = QString::fromUtf8(qUncompress(blocks[index]));
+        decoded.starts.push_back(0);
+        for (qsizetype i = 0; i < decoded.text.size(); ++i) {
+            if (decoded.text[i] == QChar(u'\0')) decoded.starts.push_back(static_cast<uint32_t>(i + 1));
+        }
+
+        std::unique_lock lock(texts.mutex);
+        block = &texts.blocks.try_emplace(index, std::move(decoded)).first->second;
+    }
+
+    const uint32_t i = ref & ((1u << INDEX_BITS) - 1);
+    return QStringView(block->text).sliced(block->starts[i], block->starts[i + 1] - block->starts[i] - 1);
+}
+
+size_t LoudsTrie::byte_size() const
+{
+    size_t bytes = louds.capacity() * sizeof(uint64_t) + zero_samples.capacity() * sizeof(uint32_t)
+        + labels.capacity() * sizeof(char16_t) + has_payload.capacity() * sizeof(uint64_t)
+        + payload_ranks.capacity() * sizeof(uint32_t) + payloads.capacity() * sizeof(Payload);
+    for (const QByteArray& block : blocks) {
+        bytes += block.size();
+    }
+    for (const auto& group : rule_groups) {
+        bytes += group.byte_size();
+    }
+    return bytes;
+}
+
+Match LoudsTrie::find(const QStringView& text, const int startPos, DecodedTexts& texts) const
+{
+    int32_t state = 0;
+    int best_len_found = 0;
+    QStringView translated;
+    Priority priority = NONE;
+    const RuleSet* rules = nullptr;
+
+    for (int i = startPos; i < text.length(); ++i) {
+        state = step(state, text[i]);
+        if (state < 0) break;
+
+        const Payload* found = payload(state);
+        if (!found) continue;
+
+        if (found->rules >= 0) {
+            rules = &rule_groups[found->rules];
+        }
+
+        if (found->name != NO_TEXT) {
+            best_len_found = i - startPos + 1;
+            translated = this->text(found->name, texts);
+            priority = NAME;
+        }
+        else if (found->phrases != NO_TEXT) {
+            if ((i - startPos + 1) > best_len_found) {
+                const QStringView list = this->text(found->phrases, texts);
+                const qsizetype separator = list.indexOf(QChar('\x1F'));
+
+                best_len_found = i - startPos + 1;
+                translated = separator < 0 ? list : list.first(separator);
+                priority = PHRASE;
+            }
+        }
+    }
+
+    return {best_len_found, priority, rules, translated, {}};
+}
+
+void LoudsTrie::find_prefixes(const QStringView& text, const int startPos, std::vector<PrefixHit>& hits,
+                              DecodedTexts& texts) const
+{
+    int32_t state = 0;
+    for (int i = startPos; i < text.length(); ++i) {
+        state = step(state, text[i]);
+        if (state < 0) break;
+
+        if (PrefixHit found; hit(state, i - startPos + 1, found, texts)) {
+            hits.push_back(found);
+        }
+    }
+}
+
+bool LoudsTrie::hit(const int32_t state, const int length, PrefixHit& hit, DecodedTexts& texts) const
+{
+    const Payload* found = payload(state);
+    if (!found) return false;
+
+    hit = {length, NONE, nullptr, {}, {}};
+
+    if (found->rules >= 0) {
+        hit.rules = &rule_groups[found->rules];
+    }
+    if (found->name != NO_TEXT) {
+        hit.priority = NAME;
+        hit.translation = text(found->name, texts);
+    }
+    else if (found->phrases != NO_TEXT) {
+        const QStringView list = text(found->phrases, texts);
+        const qsizetype separator = list.indexOf(QChar('\x1F'));
+        hit.priority = PHRASE;
+        hit.translation = separator < 0 ? list : list.first(separator);
+    }
+    return true;
+}
+
+Entry LoudsTrie::entry(const Payload* payload, DecodedTexts& texts) const
+{
+    Entry result;
+    if (!payload) return result;
+
+    if (payload->name != NO_TEXT) {
+        result.name = text(payload->name, texts);
+    }
+    if (payload->phrases != NO_TEXT) {
+        result.phrases = text(payload->phrases, texts);
+    }
+    if (payload->rules >= 0) {
+        result.rules = &rule_groups[payload->rules];
+    }
+    return result;
+}
+
+Entry LoudsTrie::find_exact(const QStringView& key, DecodedTexts& texts) const
+{
+    int32_t state = 0;
+    for (const QChar ch : key) {
+        state = step(state, ch);
+        if (state < 0) return {};
+    }
+    return entry(payload(state), texts);
+}
+
+void LoudsTrie::for_each_entry(const std::function<void(const QString&, const Entry&)>& visit) const
+{
+    DecodedTexts texts;
+    QString key;
+
+    auto walk = [&](auto&& self, const size_t node) -> void {
+        if (const Payload* found = payload(static_cast<int32_t>(node))) {
+            visit(key, entry(found, texts));
+        }
+
+        const size_t begin = node ? select_zero(node - 1) + 1 : 0;
+        const size_t end = next_zero(begin);
+        for (size_t child = begin - node + 1; child < end - node + 1; ++child) {
+            key.append(QChar(labels[child]));
+            self(self, child);
+            key.chop(1);
+        }
+    };
+    walk(walk, 0);
+}
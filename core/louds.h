@@ -0,0 +1,74 @@
+#pragma once
+
+#include <QByteArray>
+#include <QStringView>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "structures.h"
+
+// Blocks of a LoudsTrie's text decompressed for one reader. Views into them stay valid for
+// as long as the cache does; several threads may share one.
+class DecodedTexts {
+    friend class LoudsTrie;
+
+    struct Block {
+        QString text;
+        std::vector<uint32_t> starts; // Where each text of the block begins, plus one past the end.
+    };
+
+    std::shared_mutex mutex;
+    std::unordered_map<uint32_t, Block> blocks;
+};
+
+// Read-only, low-memory (LOUDS, compressed text, no readings) image of a Dictionary trie.
+class LoudsTrie {
+public:
+    // Fails on more text than its refs can address, some 4 GB of it.
+    static std::optional<LoudsTrie> build(const TrieNode* root);
+    // Same image, read straight off a double array rather than a trie thawed from it.
+    static std::optional<LoudsTrie> build(const DoubleArrayTrie& image);
+
+    [[nodiscard]] Match find(const QStringView& text, int startPos, DecodedTexts& texts) const;
+    void find_prefixes(const QStringView& text, int startPos, std::vector<PrefixHit>& hits,
+                       DecodedTexts& texts) const;
+    [[nodiscard]] Entry find_exact(const QStringView& key, DecodedTexts& texts) const;
+    void for_each_entry(const std::function<void(const QString&, const Entry&)>& visit) const;
+
+    // Same contract as DoubleArrayTrie::step().
+    [[nodiscard]] int32_t step(int32_t state, QChar ch) const;
+    bool hit(int32_t state, int length, PrefixHit& hit, DecodedTexts& texts) const;
+    [[nodiscard]] size_t byte_size() const;
+
+private:
+    static constexpr uint32_t NO_TEXT = UINT32_MAX;
+    static constexpr uint32_t ZERO_SAMPLE = 64;
+
+    struct Payload {
+        uint32_t name = NO_TEXT; // Block index in the high 20 bits, text within it in the low 12.
+        uint32_t phrases = NO_TEXT; // Every phrase, joined by \x1F.
+        int32_t rules = -1;
+    };
+
+    std::vector<uint64_t> louds; // Padded with ones, so the tail never reads as nodes.
+    std::vector<uint32_t> zero_samples; // Position of every ZERO_SAMPLE-th zero of louds.
+    std::vector<char16_t> labels; // By node; each node's children are sorted.
+    std::vector<uint64_t> has_payload; // By node.
+    std::vector<uint32_t> payload_ranks; // Payloads before each word of has_payload.
+    std::vector<Payload> payloads;
+    std::vector<QByteArray> blocks;
+    std::vector<RuleSet> rule_groups;
+
+    template <typename Source>
+    static std::optional<LoudsTrie> build_from(const Source& source);
+
+    [[nodiscard]] size_t select_zero(size_t rank) const;
+    [[nodiscard]] size_t next_zero(size_t position) const;
+    [[nodiscard]] const Payload* payload(int32_t node) const;
+    [[nodiscard]] QStringView text(uint32_t ref, DecodedTexts& texts) const;
+    [[nodiscard]] Entry entry(const Payload* payload, DecodedTexts& texts) const;
+};
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <array>
+
+#include "selfcheck.h"
+#include "converter.h"
+#include "lattice.h"
+#include "structures.h"
+
+namespace
+{
+    // A handful of names, phrases and rules, with a name set over them. Without overlaps no two
+    // keys can match text that overlaps, so there is only one way to cut any text into words.
+    struct Fixture
+    {
+        Dictionary global;
+        Dictionary name_set;
+        std::shared_ptr<const CharTable> chars;
+
+        explicit Fixture(const bool with_overlaps)
+        {
+            global.insert_bulk(u"张三", NAME, u"Trương Tam");
+            global.insert_bulk(u"中国", PHRASE, u"Trung Quốc");
+            if (with_overlaps) global.insert_bulk(u"国家", PHRASE, u"quốc gia");
+            global.insert_bulk(u"大家", PHRASE, u"mọi người");
+            global.insert_bulk(u"说", PHRASE, u"nói");
+            global.insert_rule(u"在", u"上", u"trên", u"");
+            global.insert_rule(u"把", u"", u"đem", u"");
+            global.publish();
+
+            name_set.insert_bulk(u"张三", NAME, u"Tam Trương");
+            name_set.insert_bulk(u"大人", NAME, u"Đại Nhân");
+            name_set.publish();
+
+            QHash<QChar, QString> readings;
+            const QStringView characters = u"在上把张三中国家大人的说了面";
+            const QStringList sounds = QStringView(u"tại thượng bả trương tam trung quốc gia đại nhân đích thuyết liễu diện")
+                                           .toString().split(' ');
+            for (qsizetype i = 0; i < characters.size(); ++i)
+            {
+                readings.insert(characters[i], sounds[i]);
+            }
+            const QHash<QChar, QChar> punctuations = {{u'，', u','}, {u'。', u'.'}};
+
+            auto table = std::make_shared<CharTable>();
+            table->build(readings, punctuations);
+            chars = std::move(table);
+        }
+
+        [[nodiscard]] LatticeSource source(const bool with_name_set) const
+        {
+            return {global.pin(), with_name_set ? name_set.pin() : nullptr, chars};
+        }
+    };
+
+    QString describe(const Segmentation segmentation, const bool with_name_set)
+    {
+        const QString engine = segmentation == Segmentation::Optimal ? QString("optimal") : QString("greedy");
+        return with_name_set ? engine + ", with a name set" : engine;
+    }
+
+    void compare(QStringList& failures, const QString& what, const QString& expected, const QString& actual)
+    {
+        if (expected == actual) return;
+
+        const auto [at, unused] = std::ranges::mismatch(expected, actual);
+        failures.append(what + ": outputs differ from character " + QString::number(at - expected.begin()));
+    }
+
+    // Long enough to be split across threads, out of lines that mostly end inside a rule that
+    // only closes on the next line, so that most places a run can be cut at have one crossing.
+    QString long_input()
+    {
+        static constexpr std::array LINES = {
+            u"上说张三在中国的家上，大家在",
+            u"上面说张三。把中国人说了，大家在",
+            u"张三上，在张三上，把",
+            u"中国家大人在大家上。在",
+            u"说。",
+            u"",
+        };
+
+        QString input;
+        uint32_t seed = 1;
+        while (input.size() < 100000)
+        {
+            seed = seed * 1103515245 + 12345;
+            input.append(QStringView(LINES[(seed >> 16) % LINES.size()]));
+            input.append(u'\n');
+        }
+        return input;
+    }
+}
+
+QStringList run_self_checks()
+{
+    QStringList failures;
+
+    const Fixture fixture(true);
+    const QString input = long_input();
+    for (const Segmentation segmentation : {Segmentation::Greedy, Segmentation::Optimal})
+    {
+        for (const bool with_name_set : {false, true})
+        {
+            const LatticeSource source = fixture.source(with_name_set);
+            compare(failures, "Parallel against serial conversion (" + describe(segmentation, with_name_set) + ")",
+                    convert_plain_serial(input, source, nullptr, {}, segmentation),
+                    convert_plain(input, source, nullptr, {}, segmentation));
+        }
+    }
+
+    // With one way to cut the text, the best-scoring cut is the longest-match one. The rules
+    // cover an inner word, an empty inner span and an empty end.
+    const Fixture unambiguous(false);
+    const QString text = QStringView(u"张三在中国的家上说。\n在张三上，在上，把张三说了。\n把大家说，大人在大家上。").toString();
+    for (const bool with_name_set : {false, true})
+    {
+        const LatticeSource source = unambiguous.source(with_name_set);
+        const QString what = "Optimal against greedy conversion" + QString(with_name_set ? " (with a name set)" : "");
+
+        const auto [greedy_cn, greedy_sv, greedy_vn] = convert(text, source, nullptr, {}, Segmentation::Greedy);
+        const auto [optimal_cn, optimal_sv, optimal_vn] = convert(text, source, nullptr, {}, Segmentation::Optimal);
+        compare(failures, what + ", Chinese", greedy_cn, optimal_cn);
+        compare(failures, what + ", Sino-Vietnamese", greedy_sv, optimal_sv);
+        compare(failures, what + ", Vietnamese", greedy_vn, optimal_vn);
+        compare(failures, what + ", plain", convert_plain(text, source, nullptr, {}, Segmentation::Greedy),
+                convert_plain(text, source, nullptr, {}, Segmentation::Optimal));
+    }
+    return failures;
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include <QStringList>
+
+// Converts made-up text against small dictionaries built here, in pairs of ways that have
+// to agree, and returns a line for every pair that did not. Reads none of the loaded data.
+QStringList run_self_checks();
@@ -0,0 +1,415 @@
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QSaveFile>
+#include <algorithm>
+#include <cstring>
+
+#include "snapshot.h"
+#include "datrie.h"
+#include "dict.h"
+
+namespace
+{
+    constexpr char MAGIC[8] = {'H', 'A', 'N', 'V', 'I', 'S', 'N', 'P'};
+    constexpr uint32_t FORMAT_VERSION = 2;
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+    constexpr size_t SECTION_ALIGNMENT = 8;
+
+    enum SectionId : uint32_t
+    {
+        CODE_MAP,
+        UNITS,
+        PAYLOADS,
+        TEXT,
+        RULE_GROUPS,
+        RULES,
+        SV_READINGS,
+        PUNCTUATIONS,
+        NAME_SETS,
+        NAME_SET_ENTRIES,
+        SECTION_COUNT
+    };
+
+    struct Section
+    {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t format_version;
+        uint32_t byte_order;
+        int64_t db_size;
+        int64_t db_modified;
+        Section sections[SECTION_COUNT];
+    };
+
+    struct TextRef
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    struct RuleGroupRecord
+    {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    struct RuleRecord
+    {
+        TextRef original_start;
+        TextRef original_end;
+        TextRef translation_start;
+        TextRef translation_end;
+    };
+
+    struct SvRecord
+    {
+        uint32_t key;
+        TextRef reading;
+    };
+
+    struct PunctuationRecord
+    {
+        uint16_t key;
+        uint16_t normalized;
+    };
+
+    struct NameSetRecord
+    {
+        int32_t id;
+        TextRef title;
+        uint32_t first_entry;
+        uint32_t entry_count;
+    };
+
+    struct NameSetEntryRecord
+    {
+        TextRef original;
+        TextRef translated;
+    };
+
+    QString snapshot_path(const QString& db_path)
+    {
+        const QFileInfo info(db_path);
+        return info.absolutePath() + "/" + info.completeBaseName() + ".snapshot";
+    }
+}
+
+class Snapshot
+{
+public:
+    QFile file;
+    const uchar* base = nullptr;
+
+    [[nodiscard]] const Header& header() const { return *reinterpret_cast<const Header*>(base); }
+
+    template <typename T>
+    [[nodiscard]] std::span<const T> section(const SectionId id) const
+    {
+        const auto& [offset, size] = header().sections[id];
+        return {reinterpret_cast<const T*>(base + offset), static_cast<size_t>(size / sizeof(T))};
+    }
+
+    [[nodiscard]] QStringView view(const TextRef& ref) const
+    {
+        return {section<char16_t>(TEXT).data() + ref.offset, static_cast<qsizetype>(ref.length)};
+    }
+
+    [[nodiscard]] QString text(const TextRef& ref) const
+    {
+        return view(ref).toString();
+    }
+};
+
+// Lookups follow the offsets and indices in the image without checking them, so each one is
+// checked here, against the section it points into, before anything is read through it.
+static bool contents_are_valid(const Snapshot& snapshot)
+{
+    using Trie = DoubleArrayTrie;
+    const auto code_map = snapshot.section<uint16_t>(CODE_MAP);
+    const auto units = snapshot.section<Trie::Unit>(UNITS);
+    const auto payloads = snapshot.section<Trie::Payload>(PAYLOADS);
+    const uint64_t text_size = snapshot.section<char16_t>(TEXT).size();
+    const auto rule_groups = snapshot.section<RuleGroupRecord>(RULE_GROUPS);
+    const auto rules = snapshot.section<RuleRecord>(RULES);
+    const auto set_entries = snapshot.section<NameSetEntryRecord>(NAME_SET_ENTRIES);
+
+    const auto fits = [](const uint64_t first, const uint64_t count, const uint64_t size)
+    {
+        return first <= size && count <= size - first;
+    };
+    const auto text_fits = [&](const uint32_t offset, const uint32_t length)
+    {
+        return offset == Trie::NO_TEXT || fits(offset, length, text_size);
+    };
+    const auto ref_fits = [&](const TextRef& ref)
+    {
+        return fits(ref.offset, ref.length, text_size);
+    };
+
+    if (code_map.size() != 65536 || units.empty()) return false;
+
+    // The array is padded so that base + code never leaves it.
+    const int64_t max_code = *std::ranges::max_element(code_map);
+    for (const auto& [base, check, payload] : units)
+    {
+        if (base < 0 || base + max_code >= static_cast<int64_t>(units.size())) return false;
+        if (payload < -1 || payload >= static_cast<int64_t>(payloads.size())) return false;
+    }
+
+    for (const auto& payload : payloads)
+    {
+        if (!text_fits(payload.name_offset, payload.name_length)
+            || !text_fits(payload.phrases_offset, payload.phrases_length)
+            || !text_fits(payload.reading_offset, payload.reading_length)
+            || payload.first_phrase_length > payload.phrases_length
+            || payload.rules < -1 || payload.rules >= static_cast<int64_t>(rule_groups.size()))
+        {
+            return false;
+        }
+    }
+
+    for (const auto& [first, count] : rule_groups)
+    {
+        if (!fits(first, count, rules.size())) return false;
+    }
+    for (const auto& rule : rules)
+    {
+        if (!ref_fits(rule.original_start) || !ref_fits(rule.original_end)
+            || !ref_fits(rule.translation_start) || !ref_fits(rule.translation_end))
+        {
+            return false;
+        }
+    }
+
+    for (const auto& record : snapshot.section<SvRecord>(SV_READINGS))
+    {
+        if (!ref_fits(record.reading)) return false;
+    }
+    for (const auto& record : snapshot.section<NameSetRecord>(NAME_SETS))
+    {
+        if (!ref_fits(record.title) || !fits(record.first_entry, record.entry_count, set_entries.size())) return false;
+    }
+    for (const auto& [original, translated] : set_entries)
+    {
+        if (!ref_fits(original) || !ref_fits(translated)) return false;
+    }
+    return true;
+}
+
+DbFingerprint db_fingerprint(const QString& db_path)
+{
+    const QFileInfo info(db_path);
+    if (!info.exists()) return {};
+
+    return {info.size(), info.lastModified().toMSecsSinceEpoch()};
+}
+
+bool write_snapshot(const QString& db_path, const DbFingerprint& source, const DoubleArrayTrie* trie,
+                    const SnapshotTables& tables)
+{
+    if (!trie || source.size < 0) return false;
+
+    const auto& image = trie->image();
+
+    // The trie's own pool goes first so its payload offsets stay valid; everything
+    // else is appended to the same pool.
+    std::vector<char16_t> text(image.text_pool.begin(), image.text_pool.end());
+    QHash<QString, TextRef> interned;
+    auto intern = [&](const QString& value) -> TextRef
+    {
+        if (const auto it = interned.constFind(value); it != interned.cend()) return it.value();
+
+        const TextRef ref{static_cast<uint32_t>(text.size()), static_cast<uint32_t>(value.size())};
+        const auto* begin = reinterpret_cast<const char16_t*>(value.constData());
+        text.insert(text.end(), begin, begin + value.size());
+        interned.insert(value, ref);
+        return ref;
+    };
+
+    std::vector<RuleGroupRecord> rule_groups;
+    std::vector<RuleRecord> rules;
+    for (const auto& group : trie->rules())
+    {
+        rule_groups.push_back({static_cast<uint32_t>(rules.size()), static_cast<uint32_t>(group.size())});
+        for (const auto& rule : group)
+        {
+            rules.push_back({intern(rule.original_start), intern(rule.original_end),
+                             intern(rule.translation_start), intern(rule.translation_end)});
+        }
+    }
+
+    std::vector<SvRecord> readings;
+    for (auto it = tables.sv_readings.cbegin(); it != tables.sv_readings.cend(); ++it)
+    {
+        readings.push_back({it.key().unicode(), intern(it.value())});
+    }
+    std::ranges::sort(readings, {}, &SvRecord::key);
+
+    std::vector<PunctuationRecord> punctuation_records;
+    for (auto it = tables.punctuations.cbegin(); it != tables.punctuations.cend(); ++it)
+    {
+        punctuation_records.push_back({it.key().unicode(), it.value().unicode()});
+    }
+    std::ranges::sort(punctuation_records, {}, &PunctuationRecord::key);
+
+    QHash<int, std::vector<const NameSetEntry*>> entries_by_set;
+    for (const auto& entry : tables.name_set_entries)
+    {
+        entries_by_set[entry.set_id].push_back(&entry);
+    }
+
+    std::vector<NameSetRecord> sets;
+    std::vector<NameSetEntryRecord> entries;
+    for (const auto& [index, title] : tables.name_sets)
+    {
+        const auto& set_entries = entries_by_set[index];
+        sets.push_back({index, intern(title), static_cast<uint32_t>(entries.size()), static_cast<uint32_t>(set_entries.size())});
+        for (const auto* entry : set_entries)
+        {
+            entries.push_back({intern(entry->original), intern(entry->translated)});
+        }
+    }
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.format_version = FORMAT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.db_size = source.size;
+    header.db_modified = source.modified;
+
+    QByteArray out(sizeof(Header), '\0');
+    auto append = [&]<typename T>(const SectionId id, const std::span<const T> items)
+    {
+        out.append(QByteArray((SECTION_ALIGNMENT - out.size() % SECTION_ALIGNMENT) % SECTION_ALIGNMENT, '\0'));
+        header.sections[id] = {static_cast<uint64_t>(out.size()), items.size_bytes()};
+        out.append(reinterpret_cast<const char*>(items.data()), static_cast<qsizetype>(items.size_bytes()));
+    };
+
+    append(CODE_MAP, image.code_map);
+    append(UNITS, image.units);
+    append(PAYLOADS, image.payloads);
+    append(TEXT, std::span<const char16_t>(text));
+    append(RULE_GROUPS, std::span<const RuleGroupRecord>(rule_groups));
+    append(RULES, std::span<const RuleRecord>(rules));
+    append(SV_READINGS, std::span<const SvRecord>(readings));
+    append(PUNCTUATIONS, std::span<const PunctuationRecord>(punctuation_records));
+    append(NAME_SETS, std::span<const NameSetRecord>(sets));
+    append(NAME_SET_ENTRIES, std::span<const NameSetEntryRecord>(entries));
+    std::memcpy(out.data(), &header, sizeof(Header));
+
+    // QSaveFile only replaces the old snapshot once everything is on disk, so a crash
+    // mid-write can never leave a truncated image behind.
+    QSaveFile file(snapshot_path(db_path));
+    if (!file.open(QIODevice::WriteOnly)) return false;
+    if (file.write(out) != out.size())
+    {
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
+}
+
+std::shared_ptr<const Snapshot> open_snapshot(const QString& db_path)
+{
+    auto snapshot = std::make_shared<Snapshot>();
+    snapshot->file.setFileName(snapshot_path(db_path));
+
+    if (!snapshot->file.open(QIODevice::ReadOnly)) return nullptr;
+
+    const qint64 size = snapshot->file.size();
+    if (size < static_cast<qint64>(sizeof(Header))) return nullptr;
+
+    snapshot->base = snapshot->file.map(0, size);
+    if (!snapshot->base) return nullptr;
+
+    const Header& header = snapshot->header();
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        || header.format_version != FORMAT_VERSION
+        || header.byte_order != BYTE_ORDER_MARK)
+    {
+        return nullptr;
+    }
+
+    for (const auto& [offset, length] : header.sections)
+    {
+        if (offset % SECTION_ALIGNMENT != 0 || offset > static_cast<uint64_t>(size)
+            || length > static_cast<uint64_t>(size) - offset)
+        {
+            return nullptr;
+        }
+    }
+    if (!snapshot_is_current(*snapshot, db_path) || !contents_are_valid(*snapshot)) return nullptr;
+
+    return snapshot;
+}
+
+bool snapshot_is_current(const Snapshot& snapshot, const QString& db_path)
+{
+    const auto [db_size, db_modified] = db_fingerprint(db_path);
+    return db_size >= 0 && snapshot.header().db_size == db_size && snapshot.header().db_modified == db_modified;
+}
+
+void apply_snapshot(const std::shared_ptr<const Snapshot>& snapshot)
+{
+    // Rules are few and hold QStrings, so they are rebuilt here; the arrays that make up
+    // the bulk of the image are used straight from the mapping.
+    const auto rule_records = snapshot->section<RuleRecord>(RULES);
+    std::vector<RuleSet> rule_groups;
+    for (const auto& [first, count] : snapshot->section<RuleGroupRecord>(RULE_GROUPS))
+    {
+        std::vector<Rule> group;
+        group.reserve(count);
+        for (const auto& record : rule_records.subspan(first, count))
+        {
+            group.push_back({snapshot->text(record.original_start), snapshot->text(record.original_end),
+                             snapshot->text(record.translation_start), snapshot->text(record.translation_end)});
+        }
+        rule_groups.emplace_back(std::move(group));
+    }
+
+    const DoubleArrayTrie::Image image{
+        snapshot->section<uint16_t>(CODE_MAP),
+        snapshot->section<DoubleArrayTrie::Unit>(UNITS),
+        snapshot->section<DoubleArrayTrie::Payload>(PAYLOADS),
+        snapshot->section<char16_t>(TEXT)
+    };
+    dictionary = Dictionary(DoubleArrayTrie::adopt(image, std::move(rule_groups), snapshot));
+
+    for (const auto& [key, reading] : snapshot->section<SvRecord>(SV_READINGS))
+    {
+        sv_readings.insert(QChar(static_cast<char16_t>(key)), snapshot->text(reading));
+    }
+
+    for (const auto& [key, normalized] : snapshot->section<PunctuationRecord>(PUNCTUATIONS))
+    {
+        punctuations.insert(QChar(key), QChar(normalized));
+    }
+    auto chars = std::make_shared<CharTable>();
+    chars->build(sv_readings, punctuations);
+    char_table.store(chars);
+
+    for (const auto& record : snapshot->section<NameSetRecord>(NAME_SETS))
+    {
+        name_sets.emplace_back(record.id, snapshot->text(record.title));
+    }
+}
+
+bool load_snapshot_name_set(const Snapshot& snapshot, const int id, QHash<QString, QString>& target)
+{
+    const auto sets = snapshot.section<NameSetRecord>(NAME_SETS);
+    const auto set = std::ranges::find(sets, id, &NameSetRecord::id);
+    if (set == sets.end()) return false;
+
+    target.reserve(set->entry_count);
+    for (const auto& [original, translated] : snapshot.section<NameSetEntryRecord>(NAME_SET_ENTRIES).subspan(set->first_entry, set->entry_count))
+    {
+        target.insert(snapshot.view(original).toString(), snapshot.view(translated).toString());
+    }
+    return true;
+}
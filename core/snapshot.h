@@ -0,0 +1,40 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "structures.h"
+
+// Mapped image of everything load_dict() reads, trusted while the database is unchanged.
+class Snapshot;
+
+struct DbFingerprint
+{
+    qint64 size = -1;
+    qint64 modified = -1;
+};
+
+struct NameSetEntry
+{
+    int set_id;
+    QString original;
+    QString translated;
+};
+
+// What a snapshot holds besides the dictionary, copied so any thread can write it.
+struct SnapshotTables
+{
+    QHash<QChar, QString> sv_readings;
+    QHash<QChar, QChar> punctuations;
+    std::vector<NameSet> name_sets;
+    std::vector<NameSetEntry> name_set_entries;
+};
+
+DbFingerprint db_fingerprint(const QString& db_path);
+
+bool write_snapshot(const QString& db_path, const DbFingerprint& source, const DoubleArrayTrie* trie,
+                    const SnapshotTables& tables);
+std::shared_ptr<const Snapshot> open_snapshot(const QString& db_path);
+bool snapshot_is_current(const Snapshot& snapshot, const QString& db_path);
+
+void apply_snapshot(const std::shared_ptr<const Snapshot>& snapshot);
+bool load_snapshot_name_set(const Snapshot& snapshot, int id, QHash<QString, QString>& target);
@@ -1,6 +1,15 @@
 #include "structures.h"
+#include "datrie.h"
+#include "louds.h"
 #include <algorithm>
+#include <bit>
+#include <mutex>
 #include <ranges>
+#include <unordered_set>
+
+#if defined(__SSE2__) || defined(__AVX2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 static constexpr uintptr_t TAG_MASK = 0x3;
 static constexpr uintptr_t TAG_NULL = 0x0;
@@ -8,170 +17,522 @@ static constexpr uintptr_t TAG_NAME = 0x1;
 static constexpr uintptr_t TAG_PHRASE = 0x2;
 static constexpr uintptr_t TAG_COMPLEX = 0x3;
 
-struct NodeData {
-    std::unique_ptr<QString> name;
-    std::unique_ptr<QStringList> phrases;
-    std::vector<Rule> rules;
-};
-
-using ChildEntry = std::pair<QChar, TrieNode*>;
+static constexpr uintptr_t FRESH = 0x1;
 
-struct alignas(ChildEntry) ChildHeader {
+// Followed by capacity sorted keys, then (aligned) capacity node pointers.
+struct alignas(TrieNode*) ChildHeader {
     uint16_t capacity;
     uint16_t count;
-    ChildEntry* entries() {
-        return reinterpret_cast<ChildEntry*>(this + 1);
+
+    static constexpr size_t keys_size(const size_t capacity) {
+        const size_t size = capacity * sizeof(char16_t);
+        return (size + alignof(TrieNode*) - 1) & ~(alignof(TrieNode*) - 1);
+    }
+
+    static constexpr size_t block_size(const size_t capacity) {
+        return sizeof(ChildHeader) + keys_size(capacity) + capacity * sizeof(TrieNode*);
+    }
+
+    char16_t* keys() {
+        return reinterpret_cast<char16_t*>(this + 1);
+    }
+
+    [[nodiscard]] const char16_t* keys() const {
+        return reinterpret_cast<const char16_t*>(this + 1);
+    }
+
+    TrieNode** nodes() {
+        return reinterpret_cast<TrieNode**>(reinterpret_cast<char*>(this + 1) + keys_size(capacity));
+    }
+
+    [[nodiscard]] TrieNode* const* nodes() const {
+        return reinterpret_cast<TrieNode* const*>(reinterpret_cast<const char*>(this + 1) + keys_size(capacity));
+    }
+
+    // Where ch is, or where it would go.
+    [[nodiscard]] int lower_bound(const char16_t ch) const {
+        return static_cast<int>(std::lower_bound(keys(), keys() + count, ch) - keys());
     }
 
-    [[nodiscard]] const ChildEntry* entries() const {
-        return reinterpret_cast<const ChildEntry*>(this + 1);
+    // A block of its own capacity holding the same children.
+    void copy_to(ChildHeader* target) const {
+        target->count = count;
+        std::copy_n(keys(), count, target->keys());
+        std::copy_n(nodes(), count, target->nodes());
     }
 };
 
-TrieNode* NodePool::allocate() {
-    if (current_block_offset + sizeof(TrieNode) > BLOCK_SIZE) {
+#if defined(__AVX2__)
+using KeyVector = __m256i;
+static constexpr int KEY_LANES = 16;
+#elif defined(__SSE2__) || defined(_M_X64)
+using KeyVector = __m128i;
+static constexpr int KEY_LANES = 8;
+#else
+static constexpr int KEY_LANES = 1;
+#endif
+
+// Position of ch among count sorted keys, or -1.
+static int find_key(const char16_t* keys, const int count, const char16_t ch) {
+    int low = 0;
+    int high = count;
+    while (high - low > 4 * KEY_LANES) {
+        // high stays one past anything that can still be ch.
+        const int middle = low + (high - low) / 2;
+        if (keys[middle] < ch) low = middle + 1;
+        else high = middle + 1;
+    }
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    if (count >= KEY_LANES) {
+#if defined(__AVX2__)
+        const KeyVector needle = _mm256_set1_epi16(static_cast<short>(ch));
+#else
+        const KeyVector needle = _mm_set1_epi16(static_cast<short>(ch));
+#endif
+        for (int i = low; i < high; i += KEY_LANES) {
+            // The last load is pulled back to end at count, so nothing is read past the keys;
+            // keys are unique, so a match it finds before low is still the right one.
+            const int at = std::min(i, count - KEY_LANES);
+#if defined(__AVX2__)
+            const KeyVector block = _mm256_loadu_si256(reinterpret_cast<const KeyVector*>(keys + at));
+            const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(block, needle)));
+#else
+            const KeyVector block = _mm_loadu_si128(reinterpret_cast<const KeyVector*>(keys + at));
+            const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi16(block, needle)));
+#endif
+            if (mask) return at + std::countr_zero(mask) / 2;
+        }
+        return -1;
+    }
+#endif
+
+    for (int i = low; i < high; ++i) {
+        if (keys[i] == ch) return i;
+    }
+    return -1;
+}
+
+StringArena::Handle StringArena::intern(const QStringView value) {
+    if (const auto it = index.constFind(value); it != index.cend()) {
+        return it.value();
+    }
+
+    // One word for the length, then the characters packed two to a word.
+    const size_t words = 1 + (static_cast<size_t>(value.size()) + 1) / 2;
+
+    uint32_t* slot;
+    if (words > CHUNK_WORDS) {
+        chunks.push_back(std::make_unique_for_overwrite<uint32_t[]>(words));
+        reserved_words += words;
+        slot = chunks.back().get();
+    } else {
+        if (chunk_used + words > CHUNK_WORDS) {
+            chunks.push_back(std::make_unique_for_overwrite<uint32_t[]>(CHUNK_WORDS));
+            reserved_words += CHUNK_WORDS;
+            current_chunk = chunks.back().get();
+            chunk_used = 0;
+        }
+        slot = current_chunk + chunk_used;
+        chunk_used += words;
+    }
+
+    slot[0] = static_cast<uint32_t>(value.size());
+    std::copy_n(value.utf16(), value.size(), reinterpret_cast<char16_t*>(slot + 1));
+
+    index.insert(view(slot), slot);
+    return slot;
+}
+
+void StringArena::absorb(StringArena&& other) {
+    std::ranges::move(other.chunks, std::back_inserter(chunks));
+    reserved_words += std::exchange(other.reserved_words, 0);
+    other.chunks.clear();
+    other.index.clear();
+    other.current_chunk = nullptr;
+    other.chunk_used = CHUNK_WORDS;
+}
+
+void* NodePool::allocate_bytes(const size_t size) {
+    if (size > BLOCK_SIZE) {
+        blocks.push_back(std::make_unique<char[]>(size));
+        block_bytes += size;
+        return blocks.back().get();
+    }
+
+    if (current_block_offset + size > BLOCK_SIZE) {
         auto new_block = std::make_unique<char[]>(BLOCK_SIZE);
+        block_bytes += BLOCK_SIZE;
         current_block_ptr = new_block.get();
         blocks.push_back(std::move(new_block));
         current_block_offset = 0;
     }
 
-    const auto node = new (current_block_ptr + current_block_offset) TrieNode();
-    current_block_offset += sizeof(TrieNode);
-    return node;
+    void* memory = current_block_ptr + current_block_offset;
+    current_block_offset += size;
+    return memory;
+}
+
+TrieNode* NodePool::allocate() {
+    if (!free_nodes.empty()) {
+        TrieNode* node = free_nodes.back();
+        free_nodes.pop_back();
+        return new (node) TrieNode();
+    }
+    return new (allocate_bytes(sizeof(TrieNode))) TrieNode();
+}
+
+void* NodePool::allocate_children(const size_t capacity) {
+    if (std::has_single_bit(capacity)) {
+        if (auto& free_list = free_children[std::countr_zero(capacity)]; !free_list.empty()) {
+            void* block = free_list.back();
+            free_list.pop_back();
+            return block;
+        }
+    }
+    return allocate_bytes(ChildHeader::block_size(capacity));
+}
+
+void NodePool::release_children(void* block, const size_t capacity) {
+    // A block of any size can serve the largest power of two that fits in it.
+    free_children[std::bit_width(capacity) - 1].push_back(block);
+}
+
+NodeData* NodePool::allocate_data() {
+    if (!free_data.empty()) {
+        NodeData* data = free_data.back();
+        free_data.pop_back();
+        return data;
+    }
+    return &node_data.emplace_back();
+}
+
+void NodePool::release(TrieNode* node) {
+    if (ChildHeader* header = node->header()) {
+        release_children(header, header->capacity);
+    }
+    if ((node->data & TAG_MASK) == TAG_COMPLEX) {
+        auto* complex = reinterpret_cast<NodeData*>(node->data & ~TAG_MASK);
+        *complex = NodeData{};
+        free_data.push_back(complex);
+    }
+    free_nodes.push_back(node);
+}
+
+void NodePool::absorb(NodePool&& other) {
+    std::ranges::move(other.blocks, std::back_inserter(blocks));
+    block_bytes += other.block_bytes;
+    for (size_t size_class = 0; size_class < CHILD_SIZE_CLASSES; ++size_class) {
+        auto& free_list = other.free_children[size_class];
+        free_children[size_class].insert(free_children[size_class].end(), free_list.begin(), free_list.end());
+    }
+    free_nodes.insert(free_nodes.end(), other.free_nodes.begin(), other.free_nodes.end());
+    free_data.insert(free_data.end(), other.free_data.begin(), other.free_data.end());
+
+    // Moving a deque hands over its storage, so node data keeps its address.
+    absorbed_data.push_back(std::move(other.node_data));
+    std::ranges::move(other.absorbed_data, std::back_inserter(absorbed_data));
+
+    other.clear();
 }
 
 void NodePool::clear() {
     blocks.clear();
+    for (auto& free_list : free_children) {
+        free_list.clear();
+    }
+    free_nodes.clear();
+    node_data.clear();
+    absorbed_data.clear();
+    free_data.clear();
     current_block_offset = BLOCK_SIZE;
     current_block_ptr = nullptr;
+    block_bytes = 0;
+}
+
+PoolUsage NodePool::usage() const {
+    PoolUsage usage;
+    usage.blocks = blocks.size();
+    usage.block_bytes = block_bytes;
+    usage.free_nodes = free_nodes.size();
+    for (size_t size_class = 0; size_class < CHILD_SIZE_CLASSES; ++size_class) {
+        usage.free_child_blocks += free_children[size_class].size();
+        usage.free_child_bytes += free_children[size_class].size() * ChildHeader::block_size(size_t{1} << size_class);
+    }
+    usage.node_data = node_data.size();
+    for (const auto& data : absorbed_data) {
+        usage.node_data += data.size();
+    }
+    usage.free_node_data = free_data.size();
+    return usage;
+}
+
+RuleSet::RuleSet(std::vector<Rule> rules)
+    : rules(std::move(rules)) {
+    std::ranges::stable_sort(this->rules, std::ranges::greater{}, [](const Rule& rule) {
+        return rule.original_end.size();
+    });
+    compile();
+}
+
+Rule* RuleSet::find(const QStringView end) {
+    const auto it = std::ranges::find_if(rules, [end](const Rule& rule) { return QStringView(rule.original_end) == end; });
+    return it != rules.end() ? &*it : nullptr;
+}
+
+const Rule* RuleSet::find(const QStringView end) const {
+    return const_cast<RuleSet*>(this)->find(end);
+}
+
+void RuleSet::add(const Rule& rule) {
+    // After every rule with an end at least as long, so equal ends keep the order they came in.
+    const auto at = std::ranges::upper_bound(rules, rule.original_end.size(), std::ranges::greater{},
+                                             [](const Rule& r) { return r.original_end.size(); });
+    rules.insert(at, rule);
+    compile();
+}
+
+bool RuleSet::remove(const QStringView end) {
+    if (std::erase_if(rules, [end](const Rule& rule) { return QStringView(rule.original_end) == end; }) == 0) return false;
+    compile();
+    return true;
+}
+
+size_t RuleSet::byte_size() const {
+    size_t bytes = rules.capacity() * sizeof(Rule) + states.capacity() * sizeof(State)
+        + edges.capacity() * sizeof(Edge) + (ends.capacity() + empty_ends.capacity()) * sizeof(uint32_t);
+    for (const Rule& rule : rules) {
+        bytes += (rule.original_start.size() + rule.original_end.size() + rule.translation_start.size()
+            + rule.translation_end.size()) * sizeof(char16_t);
+    }
+    return bytes;
+}
+
+void RuleSet::compile() {
+    states.clear();
+    edges.clear();
+    ends.clear();
+    empty_ends.clear();
+
+    // A plain trie of the ends first; it is flattened once they are all in.
+    struct Building {
+        std::vector<Edge> edges;
+        std::vector<uint32_t> ends;
+    };
+    std::vector<Building> trie(1);
+
+    for (uint32_t index = 0; index < rules.size(); ++index) {
+        const QString& end = rules[index].original_end;
+        if (end.isEmpty()) {
+            empty_ends.push_back(index);
+            continue;
+        }
+
+        int32_t state = 0;
+        for (const QChar ch : end) {
+            const auto& out = trie[state].edges;
+            const auto it = std::ranges::find(out, ch.unicode(), &Edge::ch);
+            if (it != out.end()) {
+                state = it->next;
+                continue;
+            }
+            const auto next = static_cast<int32_t>(trie.size());
+            trie[state].edges.push_back({ch.unicode(), next});
+            trie.emplace_back();
+            state = next;
+        }
+        trie[state].ends.push_back(index);
+    }
+    if (trie.size() == 1) return;
+
+    states.resize(trie.size());
+    for (size_t s = 0; s < trie.size(); ++s) {
+        auto& [out, ended] = trie[s];
+        std::ranges::sort(out, {}, &Edge::ch);
+
+        states[s].edges_begin = static_cast<uint32_t>(edges.size());
+        edges.insert(edges.end(), out.begin(), out.end());
+        states[s].edges_end = static_cast<uint32_t>(edges.size());
+
+        states[s].ends_begin = static_cast<uint32_t>(ends.size());
+        ends.insert(ends.end(), ended.begin(), ended.end());
+        states[s].ends_end = static_cast<uint32_t>(ends.size());
+    }
+
+    // Breadth-first, so whatever a state fails to is shallower and already linked.
+    std::vector<int32_t> queue;
+    for (uint32_t e = states[0].edges_begin; e < states[0].edges_end; ++e) {
+        queue.push_back(edges[e].next);
+    }
+    for (size_t head = 0; head < queue.size(); ++head) {
+        const int32_t parent = queue[head];
+
+        for (uint32_t e = states[parent].edges_begin; e < states[parent].edges_end; ++e) {
+            const auto [ch, child] = edges[e];
+
+            int32_t fail = states[parent].fail;
+            int32_t next;
+            while ((next = step(fail, ch)) < 0 && fail) {
+                fail = states[fail].fail;
+            }
+            State& linked = states[child];
+            linked.fail = std::max(next, 0);
+
+            const State& target = states[linked.fail];
+            linked.report = target.ends_begin != target.ends_end ? linked.fail : target.report;
+            queue.push_back(child);
+        }
+    }
 }
 
 NodePool::~NodePool() {
     clear();
 }
 
-TrieNode::~TrieNode() {
-    if (children_block) {
-        ::operator delete(children_block);
-    }
+ChildHeader* TrieNode::header() const {
+    return reinterpret_cast<ChildHeader*>(children_block & ~FRESH);
+}
 
-    free_data();
+void TrieNode::set_header(ChildHeader* header) {
+    children_block = reinterpret_cast<uintptr_t>(header) | (children_block & FRESH);
 }
 
-void TrieNode::free_data() {
-    const uintptr_t tag = data & TAG_MASK;
+bool TrieNode::is_fresh() const {
+    return children_block & FRESH;
+}
 
-    if (const auto ptr = reinterpret_cast<void*>(data & ~TAG_MASK)) {
-        if (tag == TAG_NAME) {
-            delete static_cast<QString*>(ptr);
-        } else if (tag == TAG_PHRASE) {
-            delete static_cast<QStringList*>(ptr);
-        } else if (tag == TAG_COMPLEX) {
-            delete static_cast<NodeData*>(ptr);
-        }
+void TrieNode::set_fresh(const bool fresh) {
+    children_block = fresh ? children_block | FRESH : children_block & ~FRESH;
+}
+
+TrieNode* TrieNode::copy(NodePool& pool) const {
+    TrieNode* node = pool.allocate();
+    node->set_fresh(true);
+
+    if (const ChildHeader* source = header()) {
+        auto* block = new (pool.allocate_children(source->capacity)) ChildHeader;
+        block->capacity = source->capacity;
+        source->copy_to(block);
+        node->set_header(block);
     }
-    data = TAG_NULL;
+
+    if ((data & TAG_MASK) == TAG_COMPLEX) {
+        NodeData* complex = pool.allocate_data();
+        *complex = *reinterpret_cast<const NodeData*>(data & ~TAG_MASK);
+        node->data = reinterpret_cast<uintptr_t>(complex) | TAG_COMPLEX;
+    } else {
+        node->data = data;
+    }
+    return node;
 }
 
 TrieNode* TrieNode::find_child(const QChar ch) const {
-    if (!children_block) return nullptr;
-
-    const auto* header = static_cast<ChildHeader*>(children_block);
-    const auto* begin = header->entries();
+    const auto* header = this->header();
+    if (!header) return nullptr;
 
     //Most nodes have only one child on average for CN-VN conversion.
     if (header->count == 1) {
-        return (begin->first == ch) ? begin->second : nullptr;
+        return header->keys()[0] == ch.unicode() ? header->nodes()[0] : nullptr;
     }
 
-    const auto* end = header->entries() + header->count;
-    if (header->count <= 8) {
-        for (const auto* it = begin; it != end; ++it) {
-            if (it->first == ch) return it->second;
-        }
-        return nullptr;
-    }
-    const auto it = std::lower_bound(begin, end, ch,
-        [](const std::pair<QChar, TrieNode*>& p, const QChar val) {
-            return p.first < val;
-        });
+    const int index = find_key(header->keys(), header->count, ch.unicode());
+    return index < 0 ? nullptr : header->nodes()[index];
+}
 
-    if (it != end && it->first == ch) {
-        return it->second;
-    }
-    return nullptr;
+ChildRange TrieNode::children() const {
+    const auto* header = this->header();
+    if (!header) return {};
+
+    return {header->keys(), header->nodes(), header->count};
 }
 
-void TrieNode::add_child(QChar ch, TrieNode* node) {
-    auto header = static_cast<ChildHeader*>(children_block);
+void TrieNode::add_child(QChar ch, TrieNode* node, NodePool& pool) {
+    auto header = this->header();
 
     if (!header) {
         constexpr size_t initial_cap = 2;
-        constexpr size_t size_bytes = sizeof(ChildHeader) + initial_cap * sizeof(std::pair<QChar, TrieNode*>);
-        void* mem = ::operator new(size_bytes);
-        header = new (mem) ChildHeader;
+        header = new (pool.allocate_children(initial_cap)) ChildHeader;
         header->capacity = static_cast<uint16_t>(initial_cap);
         header->count = 0;
-        children_block = header;
+        set_header(header);
     }
     else if (header->count == header->capacity) {
-        const size_t new_cap = header->capacity * 2;
-        const size_t size_bytes = sizeof(ChildHeader) + new_cap * sizeof(std::pair<QChar, TrieNode*>);
+        // Blocks from set_children() can have any size; growing one lands back on a power of two.
+        const size_t new_cap = std::bit_ceil(static_cast<size_t>(header->capacity) + 1);
 
-        void* mem = ::operator new(size_bytes);
-        auto* new_header = new (mem) ChildHeader;
+        auto* new_header = new (pool.allocate_children(new_cap)) ChildHeader;
         new_header->capacity = static_cast<uint16_t>(new_cap);
-        new_header->count = header->count;
-
-        std::uninitialized_copy_n(header->entries(), header->count, new_header->entries());
+        header->copy_to(new_header);
 
-        operator delete(children_block);
-        children_block = new_header;
+        pool.release_children(header, header->capacity);
+        set_header(new_header);
         header = new_header;
     }
 
-    auto* begin = header->entries();
-    auto* end = header->entries() + header->count;
+    const int at = header->lower_bound(ch.unicode());
+    char16_t* keys = header->keys();
+    TrieNode** nodes = header->nodes();
 
-    const auto it = std::lower_bound(begin, end, ch,
-        [](const std::pair<QChar, TrieNode*>& p, const QChar val) {
-            return p.first < val;
-        });
+    std::move_backward(keys + at, keys + header->count, keys + header->count + 1);
+    std::move_backward(nodes + at, nodes + header->count, nodes + header->count + 1);
+
+    keys[at] = ch.unicode();
+    nodes[at] = node;
+    header->count++;
+}
 
-    if (it != end) {
-        std::move_backward(it, end, end + 1);
+void TrieNode::set_children(const std::span<const ChildEntry> children, NodePool& pool) {
+    if (ChildHeader* old = header()) {
+        pool.release_children(old, old->capacity);
+        set_header(nullptr);
     }
+    if (children.empty()) return;
+
+    auto* header = new (pool.allocate_children(children.size())) ChildHeader;
+    header->capacity = static_cast<uint16_t>(children.size());
+    header->count = static_cast<uint16_t>(children.size());
+    for (size_t i = 0; i < children.size(); ++i) {
+        header->keys()[i] = children[i].first.unicode();
+        header->nodes()[i] = children[i].second;
+    }
+    set_header(header);
+}
 
-    *it = {ch, node};
-    header->count++;
+size_t TrieNode::child_capacity() const {
+    const auto* header = this->header();
+    return header ? header->capacity : 0;
+}
+
+void TrieNode::replace_child(const QChar ch, TrieNode* node) {
+    auto* header = this->header();
+    header->nodes()[header->lower_bound(ch.unicode())] = node;
 }
 
-QString* TrieNode::get_name() const {
+StringArena::Handle TrieNode::get_name() const {
     const uintptr_t tag = data & TAG_MASK;
     const uintptr_t ptr_val = data & ~TAG_MASK;
 
-    if (tag == TAG_NAME) return reinterpret_cast<QString*>(ptr_val);
+    if (tag == TAG_NAME) return reinterpret_cast<StringArena::Handle>(ptr_val);
     if (tag == TAG_COMPLEX) {
         const auto* c = reinterpret_cast<NodeData*>(ptr_val);
-        return c->name.get();
+        return c->name;
     }
     return nullptr;
 }
 
-QStringList* TrieNode::get_phrases() const {
+StringArena::Handle TrieNode::get_phrases() const {
     const uintptr_t tag = data & TAG_MASK;
     const uintptr_t ptr_val = data & ~TAG_MASK;
 
-    if (tag == TAG_PHRASE) return reinterpret_cast<QStringList*>(ptr_val);
+    if (tag == TAG_PHRASE) return reinterpret_cast<StringArena::Handle>(ptr_val);
     if (tag == TAG_COMPLEX) {
         const auto* c = reinterpret_cast<NodeData*>(ptr_val);
-        return c->phrases.get();
+        return c->phrases;
     }
     return nullptr;
 }
 
-std::vector<Rule>* TrieNode::get_rules() const {
+RuleSet* TrieNode::get_rules() const {
     if (const uintptr_t tag = data & TAG_MASK; tag == TAG_COMPLEX) {
         auto* c = reinterpret_cast<NodeData*>(data & ~TAG_MASK);
         return &c->rules;
@@ -179,150 +540,454 @@ std::vector<Rule>* TrieNode::get_rules() const {
     return nullptr;
 }
 
-void TrieNode::ensure_complex() {
+NodeData* TrieNode::ensure_complex(NodePool& pool) {
     const uintptr_t tag = data & TAG_MASK;
     const uintptr_t ptr_val = data & ~TAG_MASK;
 
-    if (tag == TAG_COMPLEX) return;
+    if (tag == TAG_COMPLEX) return reinterpret_cast<NodeData*>(ptr_val);
 
-    auto* complex = new NodeData();
+    auto* complex = pool.allocate_data();
 
     if (tag == TAG_NAME) {
-        complex->name = std::unique_ptr<QString>(reinterpret_cast<QString*>(ptr_val));
+        complex->name = reinterpret_cast<StringArena::Handle>(ptr_val);
     } else if (tag == TAG_PHRASE) {
-        complex->phrases = std::unique_ptr<QStringList>(reinterpret_cast<QStringList*>(ptr_val));
+        complex->phrases = reinterpret_cast<StringArena::Handle>(ptr_val);
     }
 
     data = reinterpret_cast<uintptr_t>(complex) | TAG_COMPLEX;
+    return complex;
 }
 
-void TrieNode::set_name(const QString& value) {
-    if (data == TAG_NULL) {
-        data = reinterpret_cast<uintptr_t>(new QString(value)) | TAG_NAME;
-        return;
-    }
-
-    if (const uintptr_t tag = data & TAG_MASK; tag == TAG_NAME) {
-        *reinterpret_cast<QString*>(data & ~TAG_MASK) = value;
+void TrieNode::set_name(const StringArena::Handle value, NodePool& pool) {
+    if (const uintptr_t tag = data & TAG_MASK; data == TAG_NULL || tag == TAG_NAME) {
+        data = reinterpret_cast<uintptr_t>(value) | TAG_NAME;
     }
     else {
-        ensure_complex();
-        auto* c = reinterpret_cast<NodeData*>(data & ~TAG_MASK);
-        c->name = std::make_unique<QString>(value);
+        ensure_complex(pool)->name = value;
     }
 }
 
-void TrieNode::add_phrase(const QString& value) {
-    if (data == TAG_NULL) {
-        auto* list = new QStringList();
-        list->prepend(value);
-        data = reinterpret_cast<uintptr_t>(list) | TAG_PHRASE;
-        return;
-    }
-
-    if (const uintptr_t tag = data & TAG_MASK; tag == TAG_PHRASE) {
-        auto* list = reinterpret_cast<QStringList*>(data & ~TAG_MASK);
-        list->removeAll(value);
-        list->prepend(value);
+void TrieNode::set_phrases(const StringArena::Handle value, NodePool& pool) {
+    if (const uintptr_t tag = data & TAG_MASK; data == TAG_NULL || tag == TAG_PHRASE) {
+        data = reinterpret_cast<uintptr_t>(value) | TAG_PHRASE;
     }
     else {
-        ensure_complex();
-        auto* c = reinterpret_cast<NodeData*>(data & ~TAG_MASK);
-        if (!c->phrases) c->phrases = std::make_unique<QStringList>();
-        c->phrases->removeAll(value);
-        c->phrases->prepend(value);
+        ensure_complex(pool)->phrases = value;
     }
 }
 
-void TrieNode::set_phrases(const QStringList& list_val) {
-     if (data == TAG_NULL) {
-        data = reinterpret_cast<uintptr_t>(new QStringList(list_val)) | TAG_PHRASE;
-        return;
-    }
-
-    const uintptr_t tag = data & TAG_MASK;
-    if (tag == TAG_PHRASE) {
-        *reinterpret_cast<QStringList*>(data & ~TAG_MASK) = list_val;
-    } else {
-        ensure_complex();
-        auto* c = reinterpret_cast<NodeData*>(data & ~TAG_MASK);
-        c->phrases = std::make_unique<QStringList>(list_val);
-    }
+void TrieNode::add_rule(const Rule& rule, NodePool& pool) {
+    ensure_complex(pool)->rules.add(rule);
 }
 
-void TrieNode::add_rule(const Rule& rule) {
-    ensure_complex();
-    auto* c = reinterpret_cast<NodeData*>(data & ~TAG_MASK);
-    c->rules.push_back(rule);
+void TrieNode::add_rules(std::vector<Rule> rules, NodePool& pool) {
+    RuleSet& current = ensure_complex(pool)->rules;
+    if (current.empty()) {
+        current = RuleSet(std::move(rules));
+        return;
+    }
 
-    std::ranges::sort(c->rules, [](const Rule& a, const Rule& b) {
-        return a.original_end.length() > b.original_end.length();
-    });
+    std::vector<Rule> merged(current.begin(), current.end());
+    std::ranges::move(rules, std::back_inserter(merged));
+    current = RuleSet(std::move(merged));
 }
 
 void TrieNode::remove_name() {
     if (const uintptr_t tag = data & TAG_MASK; tag == TAG_NAME) {
-        delete reinterpret_cast<QString*>(data & ~TAG_MASK);
         data = TAG_NULL;
     } else if (tag == TAG_COMPLEX) {
         auto* c = reinterpret_cast<NodeData*>(data & ~TAG_MASK);
-        c->name.reset();
+        c->name = nullptr;
     }
 }
 
 void TrieNode::remove_phrases() {
     if (const uintptr_t tag = data & TAG_MASK; tag == TAG_PHRASE) {
-        delete reinterpret_cast<QStringList*>(data & ~TAG_MASK);
         data = TAG_NULL;
     } else if (tag == TAG_COMPLEX) {
         auto* c = reinterpret_cast<NodeData*>(data & ~TAG_MASK);
-        c->phrases.reset();
+        c->phrases = nullptr;
     }
 }
 
-Dictionary::Dictionary() {
-    root = pool.allocate();
+static QStringList split_phrases(const StringArena::Handle phrases) {
+    if (!phrases) return {};
+    return StringArena::view(phrases).toString().split('\x1F');
 }
 
-Dictionary::~Dictionary() {
-    if (root) {
-        auto destroy_recursive = [&](auto&& self, TrieNode* n) -> void {
-            if (!n) return;
-            if (n->children_block) {
-                const auto h = static_cast<ChildHeader*>(n->children_block);
-                for (int i = 0; i < h->count; ++i) {
-                    self(self, h->entries()[i].second);
-                }
+// Everything every version of one dictionary points into. Only the writer allocates from
+// it; nodes come back to it through reclaimed once no version can reach them.
+struct DictionaryStore {
+    NodePool pool;
+    StringArena strings;
+    std::mutex reclaim_mutex;
+    std::vector<TrieNode*> reclaimed;
+};
+
+// The nodes the edits after one version replaced. Each version holds the set opened when it
+// was published, and through next every later one, so a set goes away exactly when the last
+// version that could still reach its nodes does.
+struct RetiredNodes {
+    std::shared_ptr<DictionaryStore> store;
+    std::vector<TrieNode*> nodes;
+    std::shared_ptr<RetiredNodes> next;
+
+    explicit RetiredNodes(std::shared_ptr<DictionaryStore> store) : store(std::move(store)) {}
+    ~RetiredNodes();
+};
+
+static void hand_back(RetiredNodes& retired) {
+    if (retired.nodes.empty()) return;
+
+    std::lock_guard lock(retired.store->reclaim_mutex);
+    retired.store->reclaimed.insert(retired.store->reclaimed.end(), retired.nodes.begin(), retired.nodes.end());
+    retired.nodes.clear();
+}
+
+RetiredNodes::~RetiredNodes() {
+    hand_back(*this);
+
+    // Letting each set release the next would recurse once per version when a long run of
+    // them goes at once, so the chain is unlinked here for as long as nothing else holds it.
+    std::shared_ptr<RetiredNodes> rest = std::move(next);
+    while (rest && rest.use_count() == 1) {
+        hand_back(*rest);
+        rest = std::move(rest->next);
+    }
+}
+
+const RootTable::Slot RootTable::EMPTY{};
+
+std::shared_ptr<const RootTable> RootTable::build(const TrieNode* root, const RootTable* previous)
+{
+    auto table = std::make_shared<RootTable>();
+    const ChildRange children = root->children();
+
+    for (auto it = children.begin(); it != children.end();) {
+        const size_t index = (*it).first.unicode() >> 8;
+        const Page* old = previous ? previous->pages[index].get() : nullptr;
+
+        size_t count = 0;
+        bool unchanged = old != nullptr;
+        auto page_end = it;
+        for (; page_end != children.end() && ((*page_end).first.unicode() >> 8) == index; ++page_end) {
+            const auto [ch, child] = *page_end;
+            unchanged = unchanged && old->entries[ch.unicode() & 0xFF].node == child;
+            ++count;
+        }
+
+        if (unchanged && old->used == count) {
+            table->pages[index] = previous->pages[index];
+            it = page_end;
+            continue;
+        }
+
+        auto page = std::make_shared<Page>();
+        page->used = count;
+        for (; it != page_end; ++it) {
+            const auto [ch, child] = *it;
+            const Slot& before = old ? old->entries[ch.unicode() & 0xFF] : EMPTY;
+            page->entries[ch.unicode() & 0xFF] = before.node == child ? before : summarize(child);
+        }
+        table->pages[index] = std::move(page);
+    }
+    return table;
+}
+
+RootTable::Slot RootTable::summarize(const TrieNode* node)
+{
+    Slot slot{node, 0, 0};
+
+    std::vector<std::pair<const TrieNode*, int>> pending{{node, 1}};
+    while (!pending.empty()) {
+        const auto [current, depth] = pending.back();
+        pending.pop_back();
+
+        const bool name = static_cast<bool>(current->get_name());
+        const bool rules = current->get_rules() != nullptr;
+        if (name || rules || current->get_phrases()) {
+            slot.max_length = static_cast<uint16_t>(std::clamp<int>(depth, slot.max_length, UINT16_MAX));
+        }
+        if (name) slot.flags |= HAS_NAME;
+        if (rules) slot.flags |= HAS_RULE;
+
+        for (const auto& [ch, child] : current->children()) {
+            pending.emplace_back(child, depth + 1);
+        }
+    }
+    return slot;
+}
+
+const TrieNode* DictionaryVersion::enter(const QStringView& text, const int startPos, int& stop) const
+{
+    stop = static_cast<int>(text.length());
+    if (!root || startPos >= stop) return nullptr;
+    if (!roots) return root->find_child(text[startPos]);
+
+    const RootTable::Slot& slot = roots->at(text[startPos]);
+    if (!slot.max_length) return nullptr;
+
+    stop = std::min(stop, startPos + slot.max_length);
+    return slot.node;
+}
+
+bool DictionaryVersion::may_start(const QChar ch) const
+{
+    if (frozen) return frozen->step(0, ch) >= 0;
+    if (succinct) return succinct->step(0, ch) >= 0;
+    if (roots) return roots->at(ch).max_length > 0;
+    return root && root->find_child(ch);
+}
+
+Match DictionaryVersion::find(const QStringView& text, const int startPos) const
+{
+    if (frozen) {
+        return frozen->find(text, startPos);
+    }
+    if (succinct) {
+        return succinct->find(text, startPos, *texts);
+    }
+
+    int stop = 0;
+    const TrieNode* node = enter(text, startPos, stop);
+    int best_len_found = 0;
+    QStringView translated;
+    Priority priority = NONE;
+
+    const RuleSet* rules = nullptr;
+
+    for (int i = startPos; node; node = ++i < stop ? node->find_child(text[i]) : nullptr) {
+        if (auto* r = node->get_rules())
+        {
+            rules = r;
+        }
+
+        if (const auto name = node->get_name()) {
+            best_len_found = i - startPos + 1;
+            translated = StringArena::view(name);
+            priority = NAME;
+        }
+        else if (const auto phrases = node->get_phrases()) {
+            if ((i - startPos + 1) > best_len_found) {
+                const QStringView list = StringArena::view(phrases);
+                const qsizetype separator = list.indexOf(QChar('\x1F'));
+
+                best_len_found = i - startPos + 1;
+                translated = separator < 0 ? list : list.first(separator);
+                priority = PHRASE;
             }
-            n->~TrieNode();
-        };
-        destroy_recursive(destroy_recursive, root);
+        }
+    }
+
+    return {best_len_found, priority, rules, translated, {}};
+}
+
+// Fills hit from node, if it carries anything.
+static bool node_hit(const TrieNode* node, const int length, PrefixHit& hit) {
+    hit = {length, NONE, node->get_rules(), {}, {}};
+    if (const auto name = node->get_name()) {
+        hit.priority = NAME;
+        hit.translation = StringArena::view(name);
+    }
+    else if (const auto phrases = node->get_phrases()) {
+        const QStringView list = StringArena::view(phrases);
+        const qsizetype separator = list.indexOf(QChar('\x1F'));
+        hit.priority = PHRASE;
+        hit.translation = separator < 0 ? list : list.first(separator);
+    }
+    return hit.priority != NONE || hit.rules;
+}
+
+void DictionaryVersion::find_prefixes(const QStringView& text, const int startPos, std::vector<PrefixHit>& hits) const
+{
+    if (frozen) {
+        frozen->find_prefixes(text, startPos, hits);
+        return;
+    }
+    if (succinct) {
+        succinct->find_prefixes(text, startPos, hits, *texts);
+        return;
+    }
+    int stop = 0;
+    const TrieNode* node = enter(text, startPos, stop);
+    for (int i = startPos; node; node = ++i < stop ? node->find_child(text[i]) : nullptr) {
+        if (PrefixHit hit; node_hit(node, i - startPos + 1, hit)) {
+            hits.push_back(hit);
+        }
+    }
+}
+
+// Where one version's walk has got to, in whichever trie it reads from.
+struct DictionaryVersion::Walk {
+    const DoubleArrayTrie* frozen;
+    const LoudsTrie* succinct;
+    DecodedTexts* texts;
+    const TrieNode* node = nullptr;
+    int32_t state = -1;
+    int stop = 0;
+
+    // Starts on text[startPos].
+    Walk(const DictionaryVersion& version, const QStringView& text, const int startPos)
+        : frozen(version.frozen.get()), succinct(version.succinct.get()), texts(version.texts.get())
+    {
+        if (frozen || succinct) {
+            stop = static_cast<int>(text.length());
+            if (startPos < stop) state = image_step(0, text[startPos]);
+        }
+        else if ((node = version.enter(text, startPos, stop))) {
+            state = 0;
+        }
+    }
+
+    [[nodiscard]] bool alive() const { return state >= 0; }
+
+    // Moves on to text[i], unless the walk can find nothing from there.
+    void step(const QStringView& text, const int i) {
+        if (i >= stop) {
+            state = -1;
+        }
+        else if (frozen || succinct) {
+            state = image_step(state, text[i]);
+        }
+        else if (!(node = node->find_child(text[i]))) {
+            state = -1;
+        }
+    }
+
+    [[nodiscard]] int32_t image_step(const int32_t from, const QChar ch) const {
+        return frozen ? frozen->step(from, ch) : succinct->step(from, ch);
+    }
+
+    bool hit(const int length, PrefixHit& hit) const {
+        if (frozen) return frozen->hit(state, length, hit);
+        if (succinct) return succinct->hit(state, length, hit, *texts);
+        return node_hit(node, length, hit);
+    }
+};
+
+void DictionaryVersion::find_layered_prefixes(const DictionaryVersion& overlay, const QStringView& text,
+                                              const int startPos, std::vector<PrefixHit>& hits) const
+{
+    Walk top(overlay, text, startPos);
+    Walk base(*this, text, startPos);
+
+    for (int i = startPos; top.alive() || base.alive(); ++i) {
+        const int length = i - startPos + 1;
+
+        if (top.alive()) {
+            if (PrefixHit hit; top.hit(length, hit)) {
+                hit.overlay = true;
+                hits.push_back(hit);
+            }
+            top.step(text, i + 1);
+        }
+        if (base.alive()) {
+            if (PrefixHit hit; base.hit(length, hit)) {
+                hits.push_back(hit);
+            }
+            base.step(text, i + 1);
+        }
     }
 }
 
+Entry DictionaryVersion::find_exact(const QStringView& key) const
+{
+    if (frozen) {
+        return frozen->find_exact(key);
+    }
+    if (succinct) {
+        return succinct->find_exact(key, *texts);
+    }
+
+    const TrieNode* node = walk_node(key);
+    if (!node) return {};
+
+    Entry entry;
+    if (const auto name = node->get_name()) {
+        entry.name = StringArena::view(name);
+    }
+    if (const auto phrases = node->get_phrases()) {
+        entry.phrases = StringArena::view(phrases);
+    }
+    entry.rules = node->get_rules();
+    return entry;
+}
+
+const Rule* DictionaryVersion::find_exact_rule(const QString& start, const QString& end) const
+{
+    const RuleSet* rules = nullptr;
+    if (frozen) {
+        rules = frozen->find_exact(start).rules;
+    }
+    else if (succinct) {
+        rules = succinct->find_exact(start, *texts).rules;
+    }
+    else if (const TrieNode* node = walk_node(start)) {
+        rules = node->get_rules();
+    }
+
+    return rules ? rules->find(end) : nullptr;
+}
+
+const TrieNode* DictionaryVersion::walk_node(const QStringView& key) const
+{
+    const TrieNode* node = root;
+    for (const QChar ch : key) {
+        if (!node) return nullptr;
+        node = node->find_child(ch);
+    }
+    return node;
+}
+
+Dictionary::Dictionary()
+    : store(std::make_shared<DictionaryStore>()), retired(std::make_shared<RetiredNodes>(store)),
+      published(std::make_shared<const DictionaryVersion>())
+{
+    root = new_node();
+}
+
+Dictionary::Dictionary(DoubleArrayTrie image)
+    : store(std::make_shared<DictionaryStore>()), frozen(std::make_shared<const DoubleArrayTrie>(std::move(image))),
+      editable(false), retired(std::make_shared<RetiredNodes>(store))
+{
+    root = new_node();
+    publish();
+}
+
+Dictionary::Dictionary(LoudsTrie image)
+    : store(std::make_shared<DictionaryStore>()), succinct(std::make_shared<const LoudsTrie>(std::move(image))),
+      texts(std::make_shared<DecodedTexts>()), editable(false), retired(std::make_shared<RetiredNodes>(store))
+{
+    root = new_node();
+    publish();
+}
+
+// Nodes, child blocks, node data and strings all live in the store, which the last
+// version still held releases, so nothing needs to be walked on the way out.
+Dictionary::~Dictionary() = default;
+
 Dictionary::Dictionary(Dictionary&& other) noexcept
-    : root(other.root), pool(std::move(other.pool))
+    : root(other.root), store(std::move(other.store)), frozen(std::move(other.frozen)),
+      succinct(std::move(other.succinct)), texts(std::move(other.texts)), editable(other.editable), live(other.live),
+      removed(other.removed), retired(std::move(other.retired)),
+      roots(std::move(other.roots)), thawed(std::move(other.thawed)), published(other.published.load())
 {
     other.root = nullptr;
 }
 
 Dictionary& Dictionary::operator=(Dictionary&& other) noexcept {
     if (this != &other) {
-        if (root) {
-            auto destroy_recursive = [&](auto&& self, TrieNode* n) -> void {
-                if (!n) return;
-                if (n->children_block) {
-                    auto* h = static_cast<ChildHeader*>(n->children_block);
-                    for (int i = 0; i < h->count; ++i) {
-                        self(self, h->entries()[i].second);
-                    }
-                }
-                n->~TrieNode();
-            };
-            destroy_recursive(destroy_recursive, root);
-        }
-
-        pool = std::move(other.pool);
+        store = std::move(other.store);
+        frozen = std::move(other.frozen);
+        succinct = std::move(other.succinct);
+        texts = std::move(other.texts);
+        editable = other.editable;
+        live = other.live;
+        removed = other.removed;
+        retired = std::move(other.retired);
+        roots = std::move(other.roots);
+        thawed = std::move(other.thawed);
+        published.store(other.published.load());
         root = other.root;
 
         other.root = nullptr;
@@ -330,174 +995,503 @@ Dictionary& Dictionary::operator=(Dictionary&& other) noexcept {
     return *this;
 }
 
-void Dictionary::insert(const QString& key, const QString& value, const Priority priority)
+std::shared_ptr<const DictionaryVersion> DictionaryVersion::reader(std::shared_ptr<const DictionaryVersion> version)
 {
-    TrieNode* node = root;
-    for (const QChar ch : key) {
-        TrieNode* next = node->find_child(ch);
-        if (!next) {
-            next = pool.allocate();
-            node->add_child(ch, next);
+    if (!version->succinct) return version;
+
+    auto own = std::make_shared<DictionaryVersion>(*version);
+    own->texts = std::make_shared<DecodedTexts>();
+    return own;
+}
+
+std::shared_ptr<const DictionaryVersion> Dictionary::pin() const
+{
+    // Decoded text has to outlive every view handed out from it, so each pin decodes into
+    // a cache of its own that goes when the pin does, instead of one shared cache that
+    // would end up holding every block.
+    return DictionaryVersion::reader(published.load());
+}
+
+void Dictionary::publish()
+{
+    // Batches of bulk edits are not collected as they go, so they are here.
+    collect();
+
+    auto version = std::make_shared<DictionaryVersion>();
+    version->frozen = frozen;
+    version->succinct = succinct;
+    version->store = store;
+
+    // While frozen, readers only see the image and the trie can stay private. It is still
+    // marked and summarized as published, so the edit that drops the image only copies and
+    // summarizes again what it touches.
+    if (!is_frozen()) version->root = root;
+
+    // Fresh nodes only ever hang off fresh parents, so this visits just what the
+    // edits since the last version created.
+    std::vector<TrieNode*> pending{root};
+    while (!pending.empty()) {
+        TrieNode* node = pending.back();
+        pending.pop_back();
+        if (!node->is_fresh()) continue;
+
+        node->set_fresh(false);
+        for (const auto& [ch, child] : node->children()) {
+            pending.push_back(child);
         }
-        node = next;
     }
 
-    if (priority == NAME) {
-        node->set_name(value);
+    // Only diffed against the version just replaced: nodes of anything older may have
+    // been reclaimed and handed out again, so their addresses prove nothing.
+    roots = RootTable::build(root, roots.get());
+    if (!is_frozen()) version->roots = roots;
+
+    auto next = std::make_shared<RetiredNodes>(store);
+    retired->next = next;
+    retired = std::move(next);
+    version->retired = retired;
+
+    published.store(std::move(version));
+    live = true;
+}
+
+DictionaryVersion Dictionary::current() const
+{
+    DictionaryVersion version;
+    version.root = root;
+    version.frozen = frozen;
+    version.succinct = succinct;
+    version.texts = texts;
+    return version;
+}
+
+void Dictionary::collect()
+{
+    std::vector<TrieNode*> nodes;
+    {
+        std::lock_guard lock(store->reclaim_mutex);
+        nodes.swap(store->reclaimed);
     }
-    else {
-        node->add_phrase(value);
+    for (TrieNode* node : nodes) {
+        store->pool.release(node);
     }
 }
 
-void Dictionary::insert_bulk(const QString& key, const Priority priority, const QString& value)
+void Dictionary::edited()
 {
-    TrieNode* node = root;
-    for (const QChar ch : key) {
-        TrieNode* next = node->find_child(ch);
-        if (!next) {
-            next = pool.allocate();
-            node->add_child(ch, next);
-        }
-        node = next;
-    }
+    if (live) publish();
+}
+
+void Dictionary::insert(const QString& key, const QString& value, const Priority priority)
+{
+    collect();
+    thaw();
+    drop_images();
+
+    TrieNode* node = make_node(key);
 
     if (priority == NAME) {
-        node->set_name(value);
+        node->set_name(store->strings.intern(value), store->pool);
     }
     else {
-        QStringList list;
-        for (const auto items = value.split('\x1F'); const auto& item : items) {
-            list.append(item);
-        }
-        node->set_phrases(list);
+        QStringList list = split_phrases(node->get_phrases());
+        list.removeAll(value);
+        list.prepend(value);
+        node->set_phrases(store->strings.intern(list.join('\x1F')), store->pool);
     }
+    edited();
 }
 
-std::pair<QString*, QStringList*> Dictionary::find_exact(const QStringView& key) const
+void Dictionary::insert_bulk(const QStringView key, const Priority priority, const QStringView value)
 {
-    const TrieNode* node = walk_node(key);
+    thaw();
+    drop_images();
+
+    TrieNode* node = make_node(key);
 
-    if (!node) {
-        return {nullptr, nullptr};
+    // Phrases arrive \x1F-joined from the database, which is exactly how they are kept.
+    if (priority == NAME) {
+        node->set_name(store->strings.intern(value), store->pool);
+    }
+    else {
+        node->set_phrases(store->strings.intern(value), store->pool);
     }
+}
 
-    return { node->get_name(), node->get_phrases() };
+Match Dictionary::find(const QStringView& text, const int startPos) const
+{
+    return current().find(text, startPos);
 }
 
-void Dictionary::reorder(const QString& key, const QStringList& new_order) const
+void Dictionary::find_prefixes(const QStringView& text, const int startPos, std::vector<PrefixHit>& hits) const
 {
-    TrieNode* node = walk_node(key);
-    if (!node) return;
+    current().find_prefixes(text, startPos, hits);
+}
 
-    node->set_phrases(new_order);
+Entry Dictionary::find_exact(const QStringView& key) const
+{
+    return current().find_exact(key);
 }
 
-Match Dictionary::find(const QStringView& text, const int startPos) const
+const Rule* Dictionary::find_exact_rule(const QString& start, const QString& end) const
 {
-    const TrieNode* node = root;
-    int best_len_found = 0;
-    const QString* translated = nullptr;
-    Priority priority = NONE;
+    return current().find_exact_rule(start, end);
+}
 
-    std::vector<Rule>* rules = nullptr;
+void Dictionary::reorder(const QString& key, const QStringList& new_order)
+{
+    collect();
+    thaw();
+    if (!walk_node(key)) return;
 
-    for (int i = startPos; i < text.length(); ++i) {
-        const QChar ch = text[i];
+    drop_images();
+    TrieNode* node = make_node(key);
 
-        node = node->find_child(ch);
-        if (!node) break;
+    if (new_order.isEmpty()) {
+        node->remove_phrases();
+        ++removed;
+    }
+    else {
+        node->set_phrases(store->strings.intern(new_order.join('\x1F')), store->pool);
+    }
+    edited();
+}
 
-        if (auto* r = node->get_rules())
-        {
-            rules = r;
+DictionaryStats Dictionary::stats() const
+{
+    // Served from an image, the trie here is only an empty root. The shape is read from a
+    // throwaway trie rebuilt from the image; the memory figures stay this dictionary's own.
+    if (!editable) {
+        Dictionary scratch;
+        scratch.rebuild_from(*this);
+        DictionaryStats stats = scratch.stats();
+        stats.from_image = true;
+        stats.pool = store->pool.usage();
+        stats.string_bytes = store->strings.bytes();
+        stats.image_bytes = frozen ? frozen->byte_size() : succinct->byte_size();
+        return stats;
+    }
+
+    DictionaryStats stats;
+    stats.pool = store->pool.usage();
+    stats.string_bytes = store->strings.bytes();
+    if (frozen) stats.image_bytes = frozen->byte_size();
+    if (succinct) stats.image_bytes = succinct->byte_size();
+
+    std::unordered_set<StringArena::Handle> counted;
+    auto string_bytes = [&](const StringArena::Handle handle) -> size_t {
+        if (!handle || !counted.insert(handle).second) return 0;
+        return sizeof(uint32_t) * (1 + (static_cast<size_t>(*handle) + 1) / 2);
+    };
+
+    std::vector<std::pair<const TrieNode*, size_t>> pending{{root, 0}};
+    while (!pending.empty()) {
+        const auto [node, depth] = pending.back();
+        pending.pop_back();
+
+        ++stats.nodes;
+        if (stats.depths.size() <= depth) stats.depths.resize(depth + 1);
+        ++stats.depths[depth];
+
+        const ChildRange children = node->children();
+        const auto bucket = static_cast<size_t>(std::bit_width(children.size()));
+        if (stats.fanouts.size() <= bucket) stats.fanouts.resize(bucket + 1);
+        ++stats.fanouts[bucket];
+
+        if (const size_t capacity = node->child_capacity()) {
+            ++stats.child_blocks;
+            stats.child_block_bytes += ChildHeader::block_size(capacity);
+            stats.child_block_slack += ChildHeader::block_size(capacity) - ChildHeader::block_size(children.size());
         }
 
-        if (auto* name = node->get_name()) {
-            best_len_found = i - startPos + 1;
-            translated = name;
-            priority = NAME;
+        switch (node->data & TAG_MASK) {
+        case TAG_NAME:
+            ++stats.names.nodes;
+            stats.names.bytes += string_bytes(node->get_name());
+            break;
+        case TAG_PHRASE:
+            ++stats.phrases.nodes;
+            stats.phrases.bytes += string_bytes(node->get_phrases());
+            break;
+        case TAG_COMPLEX:
+            ++stats.complex.nodes;
+            stats.complex.bytes += sizeof(NodeData) + string_bytes(node->get_name())
+                + string_bytes(node->get_phrases()) + node->get_rules()->byte_size();
+            stats.rules += node->get_rules()->size();
+            break;
+        default:
+            break;
         }
-        else if (auto* phrases = node->get_phrases()) {
-            if (!phrases->isEmpty()) {
-                if ((i - startPos + 1) > best_len_found) {
-                    best_len_found = i - startPos + 1;
-                    translated = &phrases->first();
-                    priority = PHRASE;
-                }
-            }
+
+        for (const auto& [ch, child] : children) {
+            pending.emplace_back(child, depth + 1);
         }
     }
-
-    return {best_len_found, priority, rules, translated};
+    return stats;
 }
 
 void Dictionary::insert_rule(const QString& start, const QString& end, const QString& t_start, const QString& t_end)
 {
-    TrieNode* node = root;
-    for (const QChar ch : start) {
-        TrieNode* next = node->find_child(ch);
-        if (!next) {
-            next = pool.allocate();
-            node->add_child(ch, next);
-        }
-        node = next;
-    }
+    collect();
+    thaw();
+    drop_images();
+
+    TrieNode* node = make_node(start);
 
-    node->add_rule({start, end, t_start, t_end});
+    node->add_rule({start, end, t_start, t_end}, store->pool);
+    edited();
 }
 
-const Rule* Dictionary::find_exact_rule(const QString& start, const QString& end) const
+void Dictionary::remove_rule(const QString& start, const QString& end)
 {
-    const TrieNode* node = walk_node(start);
-    if (!node) return nullptr;
+    collect();
+    thaw();
+    const TrieNode* found = walk_node(start);
+    if (!found || !found->get_rules() || !found->get_rules()->find(end)) return;
 
-    if (const auto* rules = node->get_rules())
-    {
-        const auto& rule_vector = *rules;
-        const auto it = std::ranges::find_if(rule_vector.begin(), rule_vector.end(), [end](const Rule& r)
-        {
-            return r.original_end == end;
-        });
-        if (it != rule_vector.end())
-        {
-            return &(*it);
-        }
+    drop_images();
+    const TrieNode* node = make_node(start);
+
+    node->get_rules()->remove(end);
+    ++removed;
+    edited();
+}
+
+void Dictionary::edit_rule(const QString& start, const QString& end, const QString& t_start, const QString& t_end)
+{
+    collect();
+    thaw();
+    const TrieNode* found = walk_node(start);
+    if (!found || !found->get_rules() || !found->get_rules()->find(end)) return;
+
+    drop_images();
+    const TrieNode* node = make_node(start);
+
+    Rule* rule = node->get_rules()->find(end);
+    rule->translation_start = t_start;
+    rule->translation_end = t_end;
+    edited();
+}
+
+void Dictionary::graft(Dictionary&& part)
+{
+    collect();
+    thaw();
+    drop_images();
+
+    TrieNode* top = make_node({});
+    std::vector<ChildEntry> children;
+    children.reserve(top->children().size() + part.root->children().size());
+    std::ranges::merge(top->children(), part.root->children(), std::back_inserter(children), {},
+                       &ChildEntry::first, &ChildEntry::first);
+    // Two edges on one unit would leave the second part's keys unreachable.
+    Q_ASSERT(std::ranges::adjacent_find(children, {}, &ChildEntry::first) == children.end());
+    top->set_children(children, store->pool);
+
+    store->pool.absorb(std::move(part.store->pool));
+    store->strings.absorb(std::move(part.store->strings));
+    part.root = part.new_node();
+    edited();
+}
+
+void Dictionary::freeze(const CharTable& chars, const LayoutProfile* profile)
+{
+    if (!editable) return;
+    frozen = std::make_shared<const DoubleArrayTrie>(DoubleArrayTrie::build(root, chars, profile));
+    publish();
+}
+
+void Dictionary::relayout(const CharTable& chars, const LayoutProfile& profile)
+{
+    collect();
+    thaw();
+    drop_images();
+    freeze(chars, &profile);
+}
+
+void Dictionary::compact()
+{
+    // A double array is dropped on every edit, so one still here holds exactly what the trie
+    // does, and is read as it is rather than thawed into a trie only to be walked once.
+    if (frozen) {
+        if (auto image = LoudsTrie::build(*frozen)) *this = Dictionary(std::move(*image));
+        return;
     }
-    return nullptr;
+    thaw();
+    if (auto image = LoudsTrie::build(root)) *this = Dictionary(std::move(*image));
 }
 
-void Dictionary::remove_rule(const QString& start, const QString& end) const
+Dictionary Dictionary::pruned(const DictionaryVersion& version)
 {
-    const TrieNode* node = walk_node(start);
-    if (!node) return;
+    Dictionary result;
+
+    // Children are kept sorted, so a depth-first walk hands the builder its keys in order,
+    // and the builder only lays down nodes on the way to something it was given.
+    SortedBuilder builder(result);
+
+    // A version served from an image has no trie of its own; the image's walk is in the
+    // same order.
+    if (!version.root) {
+        const auto add = [&builder](const QString& key, const Entry& entry) {
+            if (entry.name) builder.add(key, NAME, *entry.name);
+            if (entry.phrases) builder.add(key, PHRASE, *entry.phrases);
+            if (entry.rules) {
+                for (const auto& rule : *entry.rules) {
+                    builder.add_rule(rule);
+                }
+            }
+        };
+        if (version.succinct) version.succinct->for_each_entry(add);
+        if (version.frozen) version.frozen->for_each_entry(add);
+        builder.finish();
+        result.publish();
+        return result;
+    }
 
-    if (auto* rules = node->get_rules()) {
-        const auto it = std::ranges::remove_if(*rules, [&](const Rule& r) {
-            return r.translation_end == end;
-        }).begin();
+    QString key;
 
-        if (it != rules->end()) {
-            rules->erase(it, rules->end());
+    auto walk = [&](auto&& self, const TrieNode* node) -> void {
+        if (const auto name = node->get_name()) {
+            builder.add(key, NAME, StringArena::view(name));
         }
+        if (const auto phrases = node->get_phrases()) {
+            builder.add(key, PHRASE, StringArena::view(phrases));
+        }
+        if (const auto* rules = node->get_rules()) {
+            for (const auto& rule : *rules) {
+                builder.add_rule(rule);
+            }
+        }
+
+        for (const auto& [ch, child] : node->children()) {
+            key.append(ch);
+            self(self, child);
+            key.chop(1);
+        }
+    };
+    walk(walk, version.root);
+    builder.finish();
+    result.publish();
+
+    return result;
+}
+
+bool Dictionary::adopt_pruned(Dictionary&& pruned, const std::shared_ptr<const DictionaryVersion>& base)
+{
+    // Publishing clears the fresh mark all the way down, so a fresh root means edits that
+    // have not been published yet, which the copy would lose. Every edit drops the images,
+    // so one served from an image has none.
+    if (!live || (!is_frozen() && root->is_fresh()) || published.load() != base) return false;
+
+    // The old store stays with the versions still pinned and goes when the last of them does.
+    root = std::exchange(pruned.root, nullptr);
+    store = std::move(pruned.store);
+    retired = std::move(pruned.retired);
+    frozen = std::move(pruned.frozen);
+    succinct = std::move(pruned.succinct);
+    texts = std::move(pruned.texts);
+    editable = pruned.editable;
+    thawed = nullptr;
+    roots = std::move(pruned.roots);
+    removed = 0;
+
+    publish();
+    return true;
+}
+
+void Dictionary::prune()
+{
+    if (!live || is_frozen()) return;
+
+    const auto base = published.load();
+    adopt_pruned(pruned(*base), base);
+}
+
+void Dictionary::thaw_with(std::function<Dictionary()> source)
+{
+    if (!editable) thawed = std::move(source);
+}
+
+void Dictionary::thaw()
+{
+    if (editable) return;
+    editable = true;
+    if (!thawed) {
+        rebuild_from(*this);
+        return;
+    }
+
+    // Nothing reaches the trie while lookups are served from the image, so it is swapped
+    // out as a whole, like a pruned copy.
+    Dictionary copy = std::exchange(thawed, nullptr)();
+    root = std::exchange(copy.root, nullptr);
+    store = std::move(copy.store);
+    retired = std::move(copy.retired);
+    roots = std::move(copy.roots);
+}
+
+// Makes a node in this trie for every entry of the image source serves lookups from.
+void Dictionary::rebuild_from(const Dictionary& source)
+{
+    const auto rebuild = [this](const QString& key, const Entry& entry) {
+        TrieNode* node = make_node(key);
+        if (entry.name) {
+            node->set_name(store->strings.intern(*entry.name), store->pool);
+        }
+        if (entry.phrases) {
+            node->set_phrases(store->strings.intern(*entry.phrases), store->pool);
+        }
+        if (entry.rules && !entry.rules->empty()) {
+            node->add_rules({entry.rules->begin(), entry.rules->end()}, store->pool);
+        }
+    };
+    if (source.succinct) {
+        source.succinct->for_each_entry(rebuild);
+    }
+    else {
+        source.frozen->for_each_entry(rebuild);
     }
 }
 
-void Dictionary::edit_rule(const QString& start, const QString& end, const QString& t_start, const QString& t_end) const
+// The trie is about to change, so nothing built from it before may answer lookups.
+void Dictionary::drop_images()
 {
-    const TrieNode* node = walk_node(start);
-    if (!node) return;
+    frozen.reset();
+    succinct.reset();
+    texts.reset();
+}
 
-    if (auto* rules = node->get_rules()) {
-        const auto it = std::ranges::find_if(*rules, [&](const Rule& r) {
-            return r.original_end == end;
-        });
+TrieNode* Dictionary::new_node()
+{
+    TrieNode* node = store->pool.allocate();
+    node->set_fresh(true);
+    return node;
+}
 
-        if (it != rules->end()) {
-            it->translation_start = t_start;
-            it->translation_end = t_end;
+// Returns the node for key, ready to be edited: any node on the way that a published
+// version can still reach is replaced by a fresh copy and retired.
+TrieNode* Dictionary::make_node(const QStringView& key)
+{
+    if (!root->is_fresh()) {
+        retired->nodes.push_back(root);
+        root = root->copy(store->pool);
+    }
+
+    TrieNode* node = root;
+    for (const QChar ch : key) {
+        TrieNode* next = node->find_child(ch);
+        if (!next) {
+            next = new_node();
+            node->add_child(ch, next, store->pool);
         }
+        else if (!next->is_fresh()) {
+            retired->nodes.push_back(next);
+            next = next->copy(store->pool);
+            node->replace_child(ch, next);
+        }
+        node = next;
     }
+    return node;
 }
 
 TrieNode* Dictionary::walk_node(const QStringView& key) const
@@ -510,27 +1504,153 @@ TrieNode* Dictionary::walk_node(const QStringView& key) const
     return node;
 }
 
-void Dictionary::remove(const QString& key, const Priority priority) const
+// Whether node holds anything of priority for a removal to take away.
+static bool holds(const TrieNode* node, const Priority priority) {
+    if (!node) return false;
+    if (priority == NAME) return node->get_name() != nullptr;
+    if (priority == PHRASE) return node->get_phrases() != nullptr;
+    return false;
+}
+
+void Dictionary::remove(const QString& key, const Priority priority)
 {
-    TrieNode* node = walk_node(key);
-    if (!node) return;
+    collect();
+    thaw();
+    if (!holds(walk_node(key), priority)) return;
+
+    drop_images();
+    TrieNode* node = make_node(key);
 
     if (priority == NAME) {
         node->remove_name();
     } else if (priority == PHRASE) {
         node->remove_phrases();
     }
+    ++removed;
+    edited();
 }
 
-void Dictionary::remove_meaning(const QString& key, const QString& value) const
+void Dictionary::remove_bulk(const QStringView key, const Priority priority)
 {
-    TrieNode* node = walk_node(key);
-    if (!node) return;
+    thaw();
+    if (!holds(walk_node(key), priority)) return;
+
+    drop_images();
+    TrieNode* node = make_node(key);
+
+    if (priority == NAME) {
+        node->remove_name();
+    } else if (priority == PHRASE) {
+        node->remove_phrases();
+    }
+    ++removed;
+}
+
+void Dictionary::remove_meaning(const QString& key, const QString& value)
+{
+    collect();
+    thaw();
+    const TrieNode* found = walk_node(key);
+    if (!found || !split_phrases(found->get_phrases()).contains(value)) return;
+
+    drop_images();
+    TrieNode* node = make_node(key);
+
+    QStringList list = split_phrases(node->get_phrases());
+    list.removeAll(value);
+    if (list.isEmpty()) {
+        node->remove_phrases();
+    }
+    else {
+        node->set_phrases(store->strings.intern(list.join('\x1F')), store->pool);
+    }
+    ++removed;
+    edited();
+}
+
+SortedBuilder::SortedBuilder(Dictionary& target)
+    : target(target), levels(1)
+{
+    levels[0].node = target.root;
+}
+
+SortedBuilder::~SortedBuilder()
+{
+    finish();
+}
 
-    if (const auto list = node->get_phrases()) {
-        list->removeAll(value);
-        if (list->isEmpty()) {
-            node->remove_phrases();
+TrieNode* SortedBuilder::descend(const QStringView key)
+{
+    qsizetype common = 0;
+    const qsizetype limit = std::min(key.size(), path.size());
+    while (common < limit && key[common] == path[common]) {
+        ++common;
+    }
+
+    while (path.size() > common) {
+        close();
+    }
+
+    for (qsizetype i = common; i < key.size(); ++i) {
+        path.append(key[i]);
+        if (levels.size() <= static_cast<size_t>(path.size())) {
+            levels.emplace_back();
         }
+        levels[path.size()].node = target.new_node();
+    }
+    return levels[path.size()].node;
+}
+
+// The deepest open node can get no more children, so they go in now and it joins its parent's.
+void SortedBuilder::close()
+{
+    Level& level = levels[path.size()];
+    level.node->set_children(level.children, target.store->pool);
+    level.children.clear();
+
+    levels[path.size() - 1].children.emplace_back(path.back(), level.node);
+    path.chop(1);
+}
+
+void SortedBuilder::add(const QStringView key, const Priority priority, const QStringView value)
+{
+    TrieNode* node = descend(key);
+
+    if (priority == NAME) {
+        node->set_name(target.store->strings.intern(value), target.store->pool);
+    }
+    else {
+        node->set_phrases(target.store->strings.intern(value), target.store->pool);
+    }
+}
+
+void SortedBuilder::add_rule(const Rule& rule)
+{
+    TrieNode* node = descend(rule.original_start);
+    if (node != rules_node) {
+        flush_rules();
+        rules_node = node;
+    }
+    pending_rules.push_back(rule);
+}
+
+void SortedBuilder::flush_rules()
+{
+    if (!rules_node) return;
+    rules_node->add_rules(std::exchange(pending_rules, {}), target.store->pool);
+    rules_node = nullptr;
+}
+
+void SortedBuilder::finish()
+{
+    if (finished) return;
+    finished = true;
+
+    flush_rules();
+
+    while (!path.isEmpty()) {
+        close();
     }
+    levels[0].node->set_children(levels[0].children, target.store->pool);
+    levels[0].children.clear();
 }
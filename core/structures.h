@@ -1,7 +1,15 @@
 #pragma once
 
+#include <QHash>
 #include <QStringList>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <span>
 #include <vector>
 
 enum Priority { NONE, PHRASE, NAME };
@@ -14,8 +22,187 @@ struct Rule
     QString translation_end;
 };
 
+// The rules that share one start, longest end first. Their ends are compiled into an
+// Aho-Corasick automaton, so a single pass over the text after a start finds where every
+// one of them occurs, instead of one indexOf() per rule.
+class RuleSet {
+public:
+    RuleSet() = default;
+    // Sorts and compiles once, however many rules there are.
+    explicit RuleSet(std::vector<Rule> rules);
+
+    [[nodiscard]] std::vector<Rule>::const_iterator begin() const { return rules.begin(); }
+    [[nodiscard]] std::vector<Rule>::const_iterator end() const { return rules.end(); }
+    [[nodiscard]] size_t size() const { return rules.size(); }
+    [[nodiscard]] bool empty() const { return rules.empty(); }
+    [[nodiscard]] const Rule& operator[](const size_t index) const { return rules[index]; }
+
+    // The rule with the given end. Its translations may be changed through it; its end may not.
+    [[nodiscard]] Rule* find(QStringView end);
+    [[nodiscard]] const Rule* find(QStringView end) const;
+    void add(const Rule& rule);
+    // Drops every rule with the given end; false if there was none.
+    bool remove(QStringView end);
+    // Heap bytes behind the rules and the automaton, strings included.
+    [[nodiscard]] size_t byte_size() const;
+
+    // Calls found(index, at) for each place in text, at or after from, where the end of
+    // rules[index] starts. Each rule's places come in order.
+    template <typename Found>
+    void scan_ends(QStringView text, qsizetype from, Found&& found) const;
+
+private:
+    struct Edge {
+        char16_t ch;
+        int32_t next;
+    };
+
+    struct State {
+        uint32_t edges_begin = 0;
+        uint32_t edges_end = 0;
+        uint32_t ends_begin = 0;
+        uint32_t ends_end = 0;
+        int32_t fail = 0; // Longest proper suffix of the state's text that is a state too.
+        int32_t report = 0; // Nearest state down the fail chain that ends a rule; 0 if none.
+    };
+
+    std::vector<Rule> rules;
+    std::vector<State> states; // Empty when no rule has a non-empty end.
+    std::vector<Edge> edges; // Each state's, sorted by ch.
+    std::vector<uint32_t> ends; // Indices of the rules each state ends.
+    std::vector<uint32_t> empty_ends; // Rules whose empty end starts everywhere.
+
+    void compile();
+
+    [[nodiscard]] int32_t step(const int32_t state, const char16_t ch) const {
+        const Edge* first = edges.data() + states[state].edges_begin;
+        const Edge* last = edges.data() + states[state].edges_end;
+        const Edge* found = std::lower_bound(first, last, ch, [](const Edge& edge, const char16_t c) {
+            return edge.ch < c;
+        });
+        return found != last && found->ch == ch ? found->next : -1;
+    }
+};
+
+template <typename Found>
+void RuleSet::scan_ends(const QStringView text, const qsizetype from, Found&& found) const {
+    for (const uint32_t index : empty_ends) {
+        for (qsizetype at = from; at <= text.size(); ++at) {
+            found(index, at);
+        }
+    }
+    if (states.empty()) return;
+
+    int32_t state = 0;
+    for (qsizetype i = from; i < text.size(); ++i) {
+        const char16_t ch = text[i].unicode();
+        int32_t next;
+        while ((next = step(state, ch)) < 0 && state) {
+            state = states[state].fail;
+        }
+        state = std::max(next, 0);
+
+        for (int32_t s = state; s; s = states[s].report) {
+            for (uint32_t e = states[s].ends_begin; e < states[s].ends_end; ++e) {
+                found(ends[e], i + 1 - rules[ends[e]].original_end.size());
+            }
+        }
+    }
+}
+
 struct TrieNode;
-struct NodeData;
+struct ChildHeader;
+class DoubleArrayTrie;
+class LayoutProfile;
+class LoudsTrie;
+class DecodedTexts;
+class CharTable;
+
+using ChildEntry = std::pair<QChar, TrieNode*>;
+
+// A node's children as they are stored: every key in one sorted array, the nodes in another.
+class ChildRange {
+public:
+    struct iterator {
+        using value_type = ChildEntry;
+        using difference_type = std::ptrdiff_t;
+
+        const char16_t* key = nullptr;
+        TrieNode* const* node = nullptr;
+
+        ChildEntry operator*() const { return {QChar(*key), *node}; }
+        iterator& operator++() { ++key; ++node; return *this; }
+        iterator operator++(int) { const iterator old = *this; ++*this; return old; }
+        bool operator==(const iterator& other) const { return key == other.key; }
+    };
+
+    ChildRange() = default;
+    ChildRange(const char16_t* keys, TrieNode* const* nodes, const size_t count)
+        : keys(keys), nodes(nodes), count(count) {}
+
+    [[nodiscard]] iterator begin() const { return {keys, nodes}; }
+    [[nodiscard]] iterator end() const { return {keys + count, nodes + count}; }
+    [[nodiscard]] size_t size() const { return count; }
+    [[nodiscard]] bool empty() const { return count == 0; }
+
+private:
+    const char16_t* keys = nullptr;
+    TrieNode* const* nodes = nullptr;
+    size_t count = 0;
+};
+
+// Append-only store for translations. Every distinct string is kept once, and never
+// moves after being interned, so nodes and lookups can hold on to it directly.
+class StringArena {
+public:
+    // Points at the length of an interned string; its characters follow it.
+    using Handle = const uint32_t*;
+
+    StringArena() = default;
+
+    StringArena(StringArena&&) = default;
+    StringArena& operator=(StringArena&&) = default;
+
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+
+    Handle intern(QStringView value);
+    // Everything the arena has reserved, used or not.
+    [[nodiscard]] size_t bytes() const { return reserved_words * sizeof(uint32_t); }
+    // Takes over other's strings, which stay where they are. They are not indexed here,
+    // so interning one of them again stores a second copy.
+    void absorb(StringArena&& other);
+
+    static QStringView view(const Handle handle) {
+        if (!handle) return {};
+        return {reinterpret_cast<const char16_t*>(handle + 1), static_cast<qsizetype>(*handle)};
+    }
+
+private:
+    static constexpr size_t CHUNK_WORDS = 16384;
+    std::vector<std::unique_ptr<uint32_t[]>> chunks;
+    uint32_t* current_chunk = nullptr;
+    size_t chunk_used = CHUNK_WORDS;
+    size_t reserved_words = 0;
+    QHash<QStringView, Handle> index;
+};
+
+struct NodeData {
+    StringArena::Handle name = nullptr;
+    StringArena::Handle phrases = nullptr;
+    RuleSet rules;
+};
+
+// What a NodePool has carved out, and how much of it sits on free lists.
+struct PoolUsage {
+    size_t blocks = 0;
+    size_t block_bytes = 0;
+    size_t free_nodes = 0;
+    size_t free_child_blocks = 0;
+    size_t free_child_bytes = 0; // At least: a block is filed under the size it can serve.
+    size_t node_data = 0;
+    size_t free_node_data = 0;
+};
 
 class NodePool {
 public:
@@ -28,63 +215,225 @@ public:
     NodePool& operator=(const NodePool&) = delete;
 
     TrieNode* allocate();
+    void* allocate_children(size_t capacity);
+    void release_children(void* block, size_t capacity);
+    NodeData* allocate_data();
+    // Takes back a node no version of its dictionary can reach any more, along with its
+    // own child block and node data (its children are not touched).
+    void release(TrieNode* node);
+    // Takes over everything other has allocated, which stays where it is; other is left empty.
+    void absorb(NodePool&& other);
     void clear();
+    [[nodiscard]] PoolUsage usage() const;
     ~NodePool();
 
 private:
     static constexpr size_t BLOCK_SIZE = 4096;
+    static constexpr size_t CHILD_SIZE_CLASSES = 17;
     std::vector<std::unique_ptr<char[]>> blocks;
     size_t current_block_offset = BLOCK_SIZE;
     char* current_block_ptr = nullptr;
+    size_t block_bytes = 0;
+    // Child blocks outgrown by add_child(), by power-of-two capacity.
+    std::array<std::vector<void*>, CHILD_SIZE_CLASSES> free_children;
+    std::vector<TrieNode*> free_nodes;
+    std::deque<NodeData> node_data;
+    std::vector<std::deque<NodeData>> absorbed_data;
+    std::vector<NodeData*> free_data;
+
+    void* allocate_bytes(size_t size);
 };
 
 struct TrieNode {
     // Tagged pointer for data.
     // Tags (Low 2 bits):
     // 00: nullptr (No data)
-    // 01: QString* (Name translation only)
-    // 10: QStringList* (Phrase translations only)
-    // 11: ComplexNodeData* (Rules, or mixed data)
+    // 01: StringArena::Handle (Name translation only)
+    // 10: StringArena::Handle (Phrase translations only, joined by \x1F)
+    // 11: NodeData* (Rules, or mixed data)
     uintptr_t data = 0;
-    void* children_block = nullptr;
+    // ChildHeader*, with FRESH in the low bit while no published version can reach the node.
+    // Only fresh nodes are edited in place; anything else is copied first.
+    uintptr_t children_block = 0;
 
     TrieNode() = default;
 
     TrieNode(const TrieNode&) = delete;
     TrieNode& operator=(const TrieNode&) = delete;
 
-    ~TrieNode();
-
     [[nodiscard]] TrieNode* find_child(QChar ch) const;
-    void add_child(QChar ch, TrieNode* node);
+    [[nodiscard]] ChildRange children() const;
+    void add_child(QChar ch, TrieNode* node, NodePool& pool);
+    // Replaces all of the node's children with these, sorted, in a block of exactly their size.
+    void set_children(std::span<const ChildEntry> children, NodePool& pool);
+    // Points the existing edge on ch at node instead.
+    void replace_child(QChar ch, TrieNode* node);
+    // Children the node's block has room for; 0 when it has none.
+    [[nodiscard]] size_t child_capacity() const;
 
-    [[nodiscard]] QString* get_name() const;
-    [[nodiscard]] QStringList* get_phrases() const;
-    [[nodiscard]] std::vector<Rule>* get_rules() const;
+    [[nodiscard]] bool is_fresh() const;
+    void set_fresh(bool fresh);
+    // A fresh node with the same data and edges, and its own child block and node data.
+    [[nodiscard]] TrieNode* copy(NodePool& pool) const;
 
-    void set_name(const QString& value);
-    void add_phrase(const QString& value);
-    void set_phrases(const QStringList& list_val);
-    void add_rule(const Rule& rule);
+    [[nodiscard]] StringArena::Handle get_name() const;
+    [[nodiscard]] StringArena::Handle get_phrases() const;
+    [[nodiscard]] RuleSet* get_rules() const;
+
+    void set_name(StringArena::Handle value, NodePool& pool);
+    void set_phrases(StringArena::Handle value, NodePool& pool);
+    void add_rule(const Rule& rule, NodePool& pool);
+    // Adds a batch of rules with one sort and one compile.
+    void add_rules(std::vector<Rule> rules, NodePool& pool);
 
     void remove_name();
     void remove_phrases();
 
 private:
-    void ensure_complex(); 
-    void free_data();
+    friend class NodePool;
+
+    NodeData* ensure_complex(NodePool& pool);
+    [[nodiscard]] ChildHeader* header() const;
+    void set_header(ChildHeader* header);
 };
 
 struct Match {
     int length;
     Priority priority;
-    std::vector<Rule>* rules;
-    const QString* translation;
+    const RuleSet* rules;
+    QStringView translation;
+    QStringView reading; // Sino-Vietnamese reading of the match, when frozen into a double array.
+};
+
+// A node with data on the path walked from some start position.
+struct PrefixHit {
+    int length;
+    Priority priority; // NONE when the node only carries rules.
+    const RuleSet* rules;
+    QStringView translation;
+    QStringView reading;
+    bool overlay = false; // From the dictionary stacked on top, in a layered walk.
+};
+
+// What a dictionary holds for one exact key. The views stay valid for as long as the
+// version they came from is held (for Dictionary::find_exact, until the next edit).
+struct Entry {
+    std::optional<QStringView> name;
+    std::optional<QStringView> phrases; // Joined by \x1F, preferred first.
+    const RuleSet* rules = nullptr;
+};
+
+// Shape of a dictionary's trie and where its memory goes. A string several nodes share is
+// counted once, under the first node that reaches it.
+struct DictionaryStats {
+    struct Payloads {
+        size_t nodes = 0;
+        size_t bytes = 0;
+    };
+
+    size_t nodes = 0;
+    size_t child_blocks = 0;
+    size_t child_block_bytes = 0;
+    size_t child_block_slack = 0; // Bytes of room no child uses yet.
+    Payloads names; // Name only (TAG_NAME).
+    Payloads phrases; // Phrases only (TAG_PHRASE).
+    Payloads complex; // NodeData, for rules or mixed data (TAG_COMPLEX), with what it holds.
+    size_t rules = 0;
+    std::vector<size_t> depths; // Nodes at each depth, the root being at 0.
+    std::vector<size_t> fanouts; // Nodes by std::bit_width of their child count: 0, 1, 2-3, 4-7, ...
+    PoolUsage pool;
+    size_t string_bytes = 0;
+    size_t image_bytes = 0; // The double array or LOUDS image lookups are served from, if any.
+    // The trie was only rebuilt from the image to be measured: its child blocks and payloads
+    // are what thawing would take, not memory held now.
+    bool from_image = false;
 };
 
+struct DictionaryStore;
+struct RetiredNodes;
+
+// Summary of the root's child for each character, in pages of 256 shared between versions.
+class RootTable {
+public:
+    enum Flag : uint8_t { HAS_NAME = 1, HAS_RULE = 2 };
+
+    struct Slot {
+        const TrieNode* node = nullptr; // The root's child for the character.
+        uint16_t max_length = 0; // Longest key with an entry under it; 0 when there is none.
+        uint8_t flags = 0;
+    };
+
+    // Reuses whatever of previous (which may be null) still matches root's children.
+    static std::shared_ptr<const RootTable> build(const TrieNode* root, const RootTable* previous);
+
+    [[nodiscard]] const Slot& at(const QChar ch) const {
+        const Page* page = pages[ch.unicode() >> 8].get();
+        return page ? page->entries[ch.unicode() & 0xFF] : EMPTY;
+    }
+
+private:
+    struct Page {
+        std::array<Slot, 256> entries;
+        size_t used = 0;
+    };
+
+    static const Slot EMPTY;
+
+    std::array<std::shared_ptr<const Page>, 256> pages;
+
+    static Slot summarize(const TrieNode* node);
+};
+
+// One published state of a Dictionary. It never changes, and everything looked up through
+// it stays valid for as long as it is held, whatever happens to the dictionary meanwhile.
+class DictionaryVersion {
+public:
+    [[nodiscard]] Match find(const QStringView& text, int startPos) const;
+    // Appends every hit along the walk from startPos, shortest first.
+    void find_prefixes(const QStringView& text, int startPos, std::vector<PrefixHit>& hits) const;
+    // Both versions' hits along one walk that steps this version and overlay together and
+    // ends once neither has anything further. At equal length the overlay's hit comes first.
+    void find_layered_prefixes(const DictionaryVersion& overlay, const QStringView& text, int startPos,
+                               std::vector<PrefixHit>& hits) const;
+    [[nodiscard]] Entry find_exact(const QStringView& key) const;
+    [[nodiscard]] const Rule* find_exact_rule(const QString& start, const QString& end) const;
+    [[nodiscard]] const DoubleArrayTrie* image() const { return frozen.get(); }
+    // The same version with a cache of its own for text decoded from a LOUDS image, so what
+    // it decodes goes when the copy does. Any other version is handed back as it is.
+    [[nodiscard]] static std::shared_ptr<const DictionaryVersion> reader(
+        std::shared_ptr<const DictionaryVersion> version);
+    // False when no key with an entry starts with ch, so a walk from it would find nothing.
+    [[nodiscard]] bool may_start(QChar ch) const;
+
+private:
+    friend class Dictionary;
+    struct Walk;
+
+    const TrieNode* root = nullptr;
+    std::shared_ptr<const RootTable> roots; // Only for published versions read from the trie.
+    std::shared_ptr<const DoubleArrayTrie> frozen;
+    std::shared_ptr<const LoudsTrie> succinct;
+    std::shared_ptr<DecodedTexts> texts; // Where succinct's text is decoded for this reader.
+    std::shared_ptr<const DictionaryStore> store;
+    std::shared_ptr<const RetiredNodes> retired;
+
+    [[nodiscard]] const TrieNode* walk_node(const QStringView& key) const;
+    // The root's child for text[startPos], with stop lowered to where a walk from it can end.
+    [[nodiscard]] const TrieNode* enter(const QStringView& text, int startPos, int& stop) const;
+};
+
+// Single-writer dictionary with copy-on-write versions for readers on other threads.
+// Edits copy the path down to the key they change and share everything else with the
+// versions before them; a node replaced this way goes back to the pool once no version
+// that can reach it is held any more. Lookups on the Dictionary itself see the writer's
+// latest state and belong on the writer's thread; other threads pin() a version.
 class Dictionary {
 public:
     explicit Dictionary();
+    // Serves lookups straight from an image (e.g. a mapped snapshot); the editable trie
+    // is only rebuilt from it once something needs to change.
+    explicit Dictionary(DoubleArrayTrie image);
+    explicit Dictionary(LoudsTrie image);
     ~Dictionary();
     
     Dictionary(const Dictionary&) = delete;
@@ -92,29 +441,135 @@ public:
     Dictionary(Dictionary&& other) noexcept;
     Dictionary& operator=(Dictionary&& other) noexcept;
 
+    // The latest published version. Safe to call from any thread.
+    [[nodiscard]] std::shared_ptr<const DictionaryVersion> pin() const;
+
     [[nodiscard]] Match find(const QStringView& text, int startPos) const;
-    [[nodiscard]] std::pair<QString*, QStringList*> find_exact(const QStringView& key) const;
+    // Appends every hit along the walk from startPos, shortest first.
+    void find_prefixes(const QStringView& text, int startPos, std::vector<PrefixHit>& hits) const;
+    [[nodiscard]] Entry find_exact(const QStringView& key) const;
 
+    // Once a dictionary has been published, every edit below publishes a new version.
     void insert(const QString& key, const QString& value, Priority priority);
-    void insert_bulk(const QString& key, Priority priority, const QString& value);
+    // For loading: edits in place and leaves publishing to freeze() or publish().
+    void insert_bulk(QStringView key, Priority priority, QStringView value);
 
-    void remove(const QString& key, Priority priority) const;
-    void remove_meaning(const QString& key, const QString& value) const;
+    void remove(const QString& key, Priority priority);
+    // Counterpart of insert_bulk() for batches of edits.
+    void remove_bulk(QStringView key, Priority priority);
+    void remove_meaning(const QString& key, const QString& value);
 
-    void reorder(const QString& key, const QStringList& new_order) const;
+    // Hangs every key of part under this dictionary's root, along with the storage behind
+    // them, and leaves part empty. No key of part may start with a character any key here
+    // starts with, and part must never have been published: that is what lets parts be
+    // built on separate threads and joined without touching each other.
+    void graft(Dictionary&& part);
+
+    void reorder(const QString& key, const QStringList& new_order);
+
+    // Walks the whole trie, or one rebuilt from the image while lookups are served from
+    // that; meant for diagnostics, on the writer's thread.
+    [[nodiscard]] DictionaryStats stats() const;
 
     void insert_rule(const QString& start, const QString& end, const QString& t_start, const QString& t_end);
     [[nodiscard]] const Rule* find_exact_rule(const QString& start, const QString& end) const;
-    void edit_rule(const QString& start, const QString& end, const QString& t_start, const QString& t_end) const;
-    void remove_rule(const QString& start, const QString& end) const;
+    void edit_rule(const QString& start, const QString& end, const QString& t_start, const QString& t_end);
+    void remove_rule(const QString& start, const QString& end);
+
+    // Builds and publishes the double-array image find() uses until the next edit, laid out by profile if given.
+    void freeze(const CharTable& chars, const LayoutProfile* profile = nullptr);
+    // freeze() that also rebuilds whatever image an already frozen or compacted dictionary serves from.
+    void relayout(const CharTable& chars, const LayoutProfile& profile);
+    // Swaps the trie and any double array for a LoudsTrie and publishes it; no-op if it won't fit.
+    void compact();
+    // Removals only clear payloads, so the nodes that led to them stay and lookups keep
+    // walking through them. pruned() copies a version's entries into a trie without any of
+    // that: no branch that ends in nothing, no node data wrapper where one field would do,
+    // no leftover empty rule list, and nodes and child blocks laid out in depth-first order.
+    // It reads nothing but the version, so it can run on any thread while the writer goes on,
+    // and comes back published, so taking it over costs the writer nothing more.
+    [[nodiscard]] static Dictionary pruned(const DictionaryVersion& version);
+    // Takes over the trie of pruned(*base), and any image it was frozen or compacted into
+    // since, and publishes it, if base is still the latest version and nothing was edited
+    // since; otherwise the copy is stale and is dropped.
+    bool adopt_pruned(Dictionary&& pruned, const std::shared_ptr<const DictionaryVersion>& base);
+    // Both of the above at once, on the writer's thread.
+    void prune();
+    // For a dictionary served from an image: the first edit takes its trie from source,
+    // e.g. a pruned() copy under way on another thread, instead of rebuilding it there.
+    void thaw_with(std::function<Dictionary()> source);
+    // Removals since the trie was last pruned, to tell when pruning is worth it.
+    [[nodiscard]] size_t removals() const { return removed; }
+    // Makes the current contents visible to pin().
+    void publish();
+    [[nodiscard]] bool is_frozen() const { return frozen != nullptr || succinct != nullptr; }
+    [[nodiscard]] const DoubleArrayTrie* image() const { return frozen.get(); }
 
 private:
+    friend class SortedBuilder;
+
     TrieNode* root;
-    NodePool pool;
-    
+    std::shared_ptr<DictionaryStore> store;
+    std::shared_ptr<const DoubleArrayTrie> frozen;
+    std::shared_ptr<const LoudsTrie> succinct;
+    std::shared_ptr<DecodedTexts> texts; // For lookups on the writer's thread; dropped on every edit.
+    bool editable = true;
+    bool live = false; // Published at least once, so edits publish themselves.
+    size_t removed = 0;
+    std::shared_ptr<RetiredNodes> retired; // Collects what the next edit replaces.
+    std::shared_ptr<const RootTable> roots; // Summarizes the trie as last published.
+    std::function<Dictionary()> thawed; // Set by thaw_with(); taken by the first edit.
+    std::atomic<std::shared_ptr<const DictionaryVersion>> published;
+
+    [[nodiscard]] DictionaryVersion current() const;
+    void thaw();
+    void rebuild_from(const Dictionary& source);
+    void drop_images();
+    void collect();
+    void edited();
+    [[nodiscard]] TrieNode* new_node();
+    [[nodiscard]] TrieNode* make_node(const QStringView& key);
     [[nodiscard]] TrieNode* walk_node(const QStringView& key) const;
 };
 
+// Fills an empty, never published Dictionary from keys that arrive sorted, building the
+// trie bottom-up: a node's children are only laid down once its last key has gone past,
+// so each node gets one child block of exactly the right size and nothing is ever shifted.
+// Entries for the same key may arrive in any order among themselves.
+class SortedBuilder {
+public:
+    explicit SortedBuilder(Dictionary& target);
+    ~SortedBuilder();
+
+    SortedBuilder(const SortedBuilder&) = delete;
+    SortedBuilder& operator=(const SortedBuilder&) = delete;
+
+    void add(QStringView key, Priority priority, QStringView value);
+    void add_rule(const Rule& rule);
+    // Lays down whatever is still open. Nothing can be added after.
+    void finish();
+
+private:
+    struct Level {
+        TrieNode* node = nullptr;
+        std::vector<ChildEntry> children;
+    };
+
+    Dictionary& target;
+    QString path;
+    // One per character of path, plus the root; deeper ones are kept around for reuse.
+    std::vector<Level> levels;
+    // Rules of one key are gathered and handed to its node together, to be sorted and
+    // compiled once.
+    TrieNode* rules_node = nullptr;
+    std::vector<Rule> pending_rules;
+    bool finished = false;
+
+    TrieNode* descend(QStringView key);
+    void close();
+    void flush_rules();
+};
+
 struct NameSet
 {
     int index;
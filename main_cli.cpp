@@ -6,6 +6,7 @@
 
 #include "core/converter.h"
 #include "core/dict.h"
+#include "core/selfcheck.h"
 #include "core/structures.h"
 #ifdef Q_OS_WIN
 #include <windows.h>
@@ -39,7 +40,8 @@ int main(int argc, char* argv[])
     parser.addOption(input_option_folder);
 
     const QCommandLineOption name_set_used(QStringList() << "n" << "nameset",
-                                           "Use the specified nameset if exists.", "nameset");
+                                           "Use the specified nameset if exists. Repeat to stack several, "
+                                           "the first one winning.", "nameset");
     parser.addOption(name_set_used);
 
     const QCommandLineOption output_option_folder(QStringList() << "o" << "output",
@@ -50,9 +52,56 @@ int main(int argc, char* argv[])
                                         "Number of conversion jobs, default 0 (all).", "jobs", "0");
 
     parser.addOption(job_number);
+
+    const QCommandLineOption low_memory("low-memory",
+                                        "Keep the dictionary compressed in memory: a fraction of the "
+                                        "memory, for slower conversion.");
+    parser.addOption(low_memory);
+
+    const QCommandLineOption dict_stats("dict-stats",
+                                        "Print how much memory the dictionaries use and how they are "
+                                        "shaped, then exit. -i and -o are not needed.");
+    parser.addOption(dict_stats);
+
+    const QCommandLineOption segmentation_option("segmentation",
+                                                 "How to cut the text into words: greedy (default) takes the "
+                                                 "longest match first, optimal the best-scoring cut of each "
+                                                 "paragraph.", "engine", "greedy");
+    parser.addOption(segmentation_option);
+
+    const QCommandLineOption train("train-layout",
+                                   "Instead of converting, record which dictionary entries the files in -i "
+                                   "hit and lay the dictionary out for text like them. -o is not needed.");
+    parser.addOption(train);
+
+    const QCommandLineOption self_check("self-check",
+                                        "Check that the ways of converting that have to agree do, on made-up "
+                                        "text, then exit. Loads no dictionary.");
+    parser.addOption(self_check);
     parser.process(app);
 
-    if (!parser.isSet(input_option_folder) || !parser.isSet(output_option_folder))
+    if (parser.isSet(self_check))
+    {
+        const QStringList failures = run_self_checks();
+        for (const QString& failure : failures)
+        {
+            std::println("{}", failure.toStdString());
+        }
+        if (!failures.isEmpty()) return 1;
+        std::println("All self-checks passed.");
+        return 0;
+    }
+
+    const bool stats_only = parser.isSet(dict_stats);
+    const bool training = parser.isSet(train);
+
+    if (training && !parser.isSet(input_option_folder))
+    {
+        qCritical() << "Error: -i must be specified.";
+        return 1;
+    }
+
+    if (!stats_only && !training && (!parser.isSet(input_option_folder) || !parser.isSet(output_option_folder)))
     {
         qCritical() << "Error: Both -i and -o must be specified.";
         return 1;
@@ -61,13 +110,13 @@ int main(int argc, char* argv[])
     QDir inDir(parser.value(input_option_folder));
     const QDir out_dir(parser.value(output_option_folder));
 
-    if (!inDir.exists())
+    if (!stats_only && !inDir.exists())
     {
         qCritical() << "Error: Input folder does not exist:" << inDir.absolutePath();
         return 1;
     }
 
-    if (!out_dir.exists())
+    if (!stats_only && !training && !out_dir.exists())
     {
         if (!out_dir.mkpath("."))
         {
@@ -76,6 +125,19 @@ int main(int argc, char* argv[])
         }
     }
 
+    Segmentation segmentation = Segmentation::Greedy;
+    if (const QString engine = parser.value(segmentation_option); engine.compare("optimal", Qt::CaseInsensitive) == 0)
+    {
+        segmentation = Segmentation::Optimal;
+    }
+    else if (engine.compare("greedy", Qt::CaseInsensitive) != 0)
+    {
+        qCritical() << "Error: Unknown segmentation:" << engine;
+        return 1;
+    }
+
+    compact_dictionary = parser.isSet(low_memory);
+
     QElapsedTimer timer_dict;
     timer_dict.start();
 
@@ -92,7 +154,8 @@ int main(int argc, char* argv[])
             QThreadPool::globalInstance()->setMaxThreadCount(jobs);
         }
 
-        if (const auto set_specified = parser.value(name_set_used); !set_specified.isEmpty())
+        std::vector<int> stack;
+        for (const auto& set_specified : parser.values(name_set_used))
         {
             const auto set_chosen = std::ranges::find_if(name_sets, [&](const NameSet& name_set)
             {
@@ -104,10 +167,17 @@ int main(int argc, char* argv[])
             }
             else
             {
-                const auto& [index, title] = *set_chosen;
-                load_name_set(index);
+                stack.push_back(set_chosen->index);
             }
         }
+        set_active_name_sets(std::move(stack));
+
+        if (stats_only)
+        {
+            write_std_out(dictionary_report());
+            QCoreApplication::quit();
+            return;
+        }
 
         QStringList filters;
         filters << "*.txt";
@@ -121,9 +191,36 @@ int main(int argc, char* argv[])
             return;
         }
 
+        if (training)
+        {
+            QStringList texts;
+            for (const QFileInfo& file_info : files)
+            {
+                QFile in_file(file_info.absoluteFilePath());
+                if (!in_file.open(QIODevice::ReadOnly | QIODevice::Text))
+                {
+                    qWarning() << "Skipping: Cannot open" << file_info.fileName();
+                    continue;
+                }
+
+                QTextStream in(&in_file);
+                in.setEncoding(QStringConverter::Utf8);
+                texts.append(in.readAll());
+            }
+
+            std::println("Training the dictionary layout on {} files.", texts.size());
+            if (!train_layout(texts))
+            {
+                qCritical() << "Error: Could not save the trained layout.";
+            }
+            QCoreApplication::quit();
+            return;
+        }
+
         std::println("Processing {} files.", files.size());
 
         QMutex console_mutex;
+        const LatticeSource source = LatticeSource::pin();
 
         auto process_file = [&](const QFileInfo& file_info)
         {
@@ -142,7 +239,7 @@ int main(int argc, char* argv[])
             const QString content = in.readAll();
             in_file.close();
 
-            const QString result = convert_plain(content);
+            const QString result = convert_plain(content, source, nullptr, {}, segmentation);
             const QString out_name = file_info.baseName() + "_converted.txt";
             const QString out_path = out_dir.filePath(out_name);
 